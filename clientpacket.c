@@ -66,34 +66,34 @@ unsigned long random_xid(void)
 }
 
 
-/* initialize a packet with the proper defaults */
-static void init_packet(struct dhcpMessage *packet, char type)
+/* initialize a packet with the proper defaults, the rest of its options
+ * go in through opts */
+static void init_packet(struct dhcpMessage *packet, struct option_writer *opts, char type)
 {
-	init_header(packet, type);
+	init_header(packet, type, opts);
 	memcpy(packet->chaddr, client_config.arp, 6);
 	if (client_config.clientid)
-	    add_option_string(packet->options, client_config.clientid);
-	if (client_config.hostname) add_option_string(packet->options, client_config.hostname);
-	if (client_config.fqdn) add_option_string(packet->options, client_config.fqdn);
-	add_option_string(packet->options, client_config.vendorclass);
+	    put_option_string(opts, client_config.clientid);
+	if (client_config.hostname) put_option_string(opts, client_config.hostname);
+	if (client_config.fqdn) put_option_string(opts, client_config.fqdn);
+	put_option_string(opts, client_config.vendorclass);
 }
 
 
 /* Add a parameter request list for stubborn DHCP servers. Pull the data
- * from the struct in options.c. Don't do bounds checking here because it
- * goes towards the head of the packet. */
-static void add_requests(struct dhcpMessage *packet)
+ * from the struct in options.c. */
+static void add_requests(struct option_writer *opts)
 {
-	int end = end_option(packet->options);
+	uint8_t *data;
 	int i, len = 0;
 
-	packet->options[end + OPT_CODE] = DHCP_PARAM_REQ;
+	for (i = 0; dhcp_options[i].code; i++)
+		if (dhcp_options[i].flags & OPTION_REQ) len++;
+	if (!(data = put_option(opts, DHCP_PARAM_REQ, len)))
+		return;
 	for (i = 0; dhcp_options[i].code; i++)
 		if (dhcp_options[i].flags & OPTION_REQ)
-			packet->options[end + OPT_DATA + len++] = dhcp_options[i].code;
-	packet->options[end + OPT_LEN] = len;
-	packet->options[end + OPT_DATA + len] = DHCP_END;
-
+			*data++ = dhcp_options[i].code;
 }
 
 
@@ -101,13 +101,14 @@ static void add_requests(struct dhcpMessage *packet)
 int send_discover(unsigned long xid, unsigned long requested)
 {
 	struct dhcpMessage packet;
+	struct option_writer opts;
 
-	init_packet(&packet, DHCPDISCOVER);
+	init_packet(&packet, &opts, DHCPDISCOVER);
 	packet.xid = xid;
 	if (requested)
-		add_simple_option(packet.options, DHCP_REQUESTED_IP, requested);
+		put_simple_option(&opts, DHCP_REQUESTED_IP, requested);
 
-	add_requests(&packet);
+	add_requests(&opts);
 	LOG(LOG_DEBUG, "Sending discover...");
 	return raw_packet(&packet, INADDR_ANY, CLIENT_PORT, INADDR_BROADCAST,
 				SERVER_PORT, MAC_BCAST_ADDR, client_config.ifindex);
@@ -118,15 +119,16 @@ int send_discover(unsigned long xid, unsigned long requested)
 int send_selecting(unsigned long xid, unsigned long server, unsigned long requested)
 {
 	struct dhcpMessage packet;
+	struct option_writer opts;
 	struct in_addr addr;
 
-	init_packet(&packet, DHCPREQUEST);
+	init_packet(&packet, &opts, DHCPREQUEST);
 	packet.xid = xid;
 
-	add_simple_option(packet.options, DHCP_REQUESTED_IP, requested);
-	add_simple_option(packet.options, DHCP_SERVER_ID, server);
+	put_simple_option(&opts, DHCP_REQUESTED_IP, requested);
+	put_simple_option(&opts, DHCP_SERVER_ID, server);
 
-	add_requests(&packet);
+	add_requests(&opts);
 	addr.s_addr = requested;
 	LOG(LOG_DEBUG, "Sending select for %s...", inet_ntoa(addr));
 	return raw_packet(&packet, INADDR_ANY, CLIENT_PORT, INADDR_BROADCAST,
@@ -138,13 +140,14 @@ int send_selecting(unsigned long xid, unsigned long server, unsigned long reques
 int send_renew(unsigned long xid, unsigned long server, unsigned long ciaddr)
 {
 	struct dhcpMessage packet;
+	struct option_writer opts;
 	int ret = 0;
 
-	init_packet(&packet, DHCPREQUEST);
+	init_packet(&packet, &opts, DHCPREQUEST);
 	packet.xid = xid;
 	packet.ciaddr = ciaddr;
 
-	add_requests(&packet);
+	add_requests(&opts);
 	LOG(LOG_DEBUG, "Sending renew...");
 	if (server)
 		ret = kernel_packet(&packet, ciaddr, CLIENT_PORT, server, SERVER_PORT);
@@ -158,21 +161,23 @@ int send_renew(unsigned long xid, unsigned long server, unsigned long ciaddr)
 int send_release(unsigned long server, unsigned long ciaddr)
 {
 	struct dhcpMessage packet;
+	struct option_writer opts;
 
-	init_packet(&packet, DHCPRELEASE);
+	init_packet(&packet, &opts, DHCPRELEASE);
 	packet.xid = random_xid();
 	packet.ciaddr = ciaddr;
 
-	add_simple_option(packet.options, DHCP_REQUESTED_IP, ciaddr);
-	add_simple_option(packet.options, DHCP_SERVER_ID, server);
+	put_simple_option(&opts, DHCP_REQUESTED_IP, ciaddr);
+	put_simple_option(&opts, DHCP_SERVER_ID, server);
 
 	LOG(LOG_DEBUG, "Sending release...");
 	return kernel_packet(&packet, ciaddr, CLIENT_PORT, server, SERVER_PORT);
 }
 
 
-/* return -1 on errors that are fatal for the socket, -2 for those that aren't */
-int get_raw_packet(struct dhcpMessage *payload, int fd)
+/* Read a packet and index its options into options. Return -1 on errors
+ * that are fatal for the socket, -2 for those that aren't */
+int get_raw_packet(struct dhcpMessage *payload, struct option_index *options, int fd)
 {
 	int bytes;
 	struct udp_dhcp_packet packet;
@@ -239,6 +244,8 @@ int get_raw_packet(struct dhcpMessage *payload, int fd)
 		LOG(LOG_ERR, "received bogus message (bad magic) -- ignoring");
 		return -2;
 	}
+	if (index_options(options, payload) < 0)
+		return -2;
 	DEBUG(LOG_INFO, "oooooh!!! got some!");
 	return bytes - (sizeof(packet.ip) + sizeof(packet.udp));
 
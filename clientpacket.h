@@ -3,12 +3,14 @@
 
 #include "packet.h"
 
+struct option_index;
+
 unsigned long random_xid(void);
 int send_discover(unsigned long xid, unsigned long requested);
 int send_selecting(unsigned long xid, unsigned long server, unsigned long requested);
 int send_renew(unsigned long xid, unsigned long server, unsigned long ciaddr);
 int send_renew(unsigned long xid, unsigned long server, unsigned long ciaddr);
 int send_release(unsigned long server, unsigned long ciaddr);
-int get_raw_packet(struct dhcpMessage *payload, int fd);
+int get_raw_packet(struct dhcpMessage *payload, struct option_index *options, int fd);
 
 #endif
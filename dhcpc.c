@@ -30,7 +30,7 @@
 #include "clientsocket.h"
 #include "script.h"
 #include "socket.h"
-#include "signalpipe.h"
+#include "events.h"
 
 static int state;
 static unsigned long requested_ip; /* = 0 */
@@ -180,14 +180,12 @@ int main(int argc, char *argv[])
 	uint8_t *temp, *message;
 	unsigned long t1 = 0, t2 = 0, xid = 0;
 	unsigned long start = 0, lease;
-	fd_set rfds;
 	int retval;
-	struct timeval tv;
 	int c, len;
 	struct dhcpMessage packet;
+	struct option_index options;
 	struct in_addr temp_addr;
 	long now;
-	int max_fd;
 	int sig;
 	int no_clientid = 0;
 
@@ -332,8 +330,8 @@ int main(int argc, char *argv[])
 	}
 
 
-	/* setup the signal pipe */
-	udhcp_sp_setup();
+	/* setup the event loop */
+	udhcp_ev_setup();
 
 	state = INIT_SELECTING;
 	run_script(NULL, "deconfig");
@@ -341,25 +339,23 @@ int main(int argc, char *argv[])
 
 	for (;;) {
 
-		tv.tv_sec = timeout - uptime();
-		tv.tv_usec = 0;
-
 		if (listen_mode != LISTEN_NONE && fd < 0) {
 			if (listen_mode == LISTEN_KERNEL)
-				fd = listen_socket(INADDR_ANY, CLIENT_PORT, client_config.interface);
+				fd = listen_socket(INADDR_ANY, CLIENT_PORT, client_config.interface, 0);
 			else
 				fd = raw_socket(client_config.ifindex);
 			if (fd < 0) {
 				LOG(LOG_ERR, "FATAL: couldn't listen on socket, %m");
 				return 0;
 			}
+			udhcp_ev_add(fd);
 		}
-		max_fd = udhcp_sp_fd_set(&rfds, fd);
 
-		if (tv.tv_sec > 0) {
-			DEBUG(LOG_INFO, "Waiting on select...");
-			retval = select(max_fd + 1, &rfds, NULL, NULL, &tv);
-		} else retval = 0; /* If we already timed out, fall through */
+		/* If we already timed out, this falls right through */
+		now = timeout - uptime();
+		udhcp_ev_timer(now > 0 ? now : 0);
+		DEBUG(LOG_INFO, "Waiting on epoll...");
+		retval = udhcp_ev_wait();
 
 		now = uptime();
 		if (retval == 0) {
@@ -452,12 +448,12 @@ int main(int argc, char *argv[])
 				timeout = 0x7fffffff;
 				break;
 			}
-		} else if (retval > 0 && listen_mode != LISTEN_NONE && FD_ISSET(fd, &rfds)) {
+		} else if (retval > 0 && listen_mode != LISTEN_NONE && udhcp_ev_ready(fd)) {
 			/* a packet is ready, read it */
 
 			if (listen_mode == LISTEN_KERNEL)
-				len = get_packet(&packet, fd);
-			else len = get_raw_packet(&packet, fd);
+				len = get_packet(&packet, &options, fd);
+			else len = get_raw_packet(&packet, &options, fd);
 
 			if (len == -1 && errno != EINTR) {
 				DEBUG(LOG_INFO, "error on read, %m, reopening socket");
@@ -477,7 +473,7 @@ int main(int argc, char *argv[])
 				continue;
 			}
 
-			if ((message = get_option(&packet, DHCP_MESSAGE_TYPE)) == NULL) {
+			if ((message = get_option(&options, DHCP_MESSAGE_TYPE)) == NULL) {
 				DEBUG(LOG_ERR, "couldnt get option from packet -- ignoring");
 				continue;
 			}
@@ -486,7 +482,7 @@ int main(int argc, char *argv[])
 			case INIT_SELECTING:
 				/* Must be a DHCPOFFER to one of our xid's */
 				if (*message == DHCPOFFER) {
-					if ((temp = get_option(&packet, DHCP_SERVER_ID))) {
+					if ((temp = get_option(&options, DHCP_SERVER_ID))) {
 						memcpy(&server_addr, temp, 4);
 						xid = packet.xid;
 						requested_ip = packet.yiaddr;
@@ -505,7 +501,7 @@ int main(int argc, char *argv[])
 			case RENEWING:
 			case REBINDING:
 				if (*message == DHCPACK) {
-					if (!(temp = get_option(&packet, DHCP_LEASE_TIME))) {
+					if (!(temp = get_option(&options, DHCP_LEASE_TIME))) {
 						LOG(LOG_ERR, "No lease time with ACK, using 1 hour lease");
 						lease = 60 * 60;
 					} else {
@@ -524,7 +520,7 @@ int main(int argc, char *argv[])
 					start = now;
 					timeout = t1 + start;
 					requested_ip = packet.yiaddr;
-					run_script(&packet,
+					run_script(&options,
 						   ((state == RENEWING || state == REBINDING) ? "renew" : "bound"));
 
 					state = BOUND;
@@ -537,7 +533,7 @@ int main(int argc, char *argv[])
 				} else if (*message == DHCPNAK) {
 					/* return to init state */
 					LOG(LOG_INFO, "Received DHCP NAK");
-					run_script(&packet, "nak");
+					run_script(&options, "nak");
 					if (state != REQUESTING)
 						run_script(NULL, "deconfig");
 					state = INIT_SELECTING;
@@ -550,7 +546,7 @@ int main(int argc, char *argv[])
 				break;
 			/* case BOUND, RELEASED: - ignore all packets */
 			}
-		} else if (retval > 0 && (sig = udhcp_sp_read(&rfds))) {
+		} else if (retval > 0 && (sig = udhcp_ev_signal())) {
 			switch (sig) {
 			case SIGUSR1:
 				perform_renew();
@@ -566,7 +562,7 @@ int main(int argc, char *argv[])
 			/* a signal was caught */
 		} else {
 			/* An error occured */
-			DEBUG(LOG_ERR, "Error on select");
+			DEBUG(LOG_ERR, "Error on epoll_wait");
 		}
 
 	}
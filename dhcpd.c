@@ -43,43 +43,150 @@
 #include "files.h"
 #include "serverpacket.h"
 #include "common.h"
-#include "signalpipe.h"
+#include "events.h"
+#include "workers.h"
+#include "uring.h"
 #include "static_leases.h"
 
 
 /* globals */
-struct dhcpOfferedAddr *leases;
-struct server_config_t server_config;
+struct server_config_t *server_configs;
+__thread struct server_config_t *cur_config;
 
 
-#ifdef COMBINED_BINARY
-int udhcpd_main(int argc, char *argv[])
-#else
-int main(int argc, char *argv[])
-#endif
+/* act on a single packet from a client, with its options indexed in options */
+static void handle_packet(struct dhcpMessage *packet, struct option_index *options)
 {
-	fd_set rfds;
-	struct timeval tv;
-	int server_socket = -1;
-	int bytes, retval;
-	struct dhcpMessage packet;
 	uint8_t *state;
 	uint8_t *server_id, *requested;
-	uint32_t server_id_align, requested_align;
-	unsigned long timeout_end;
-	struct option_set *option;
-	struct dhcpOfferedAddr *lease;
-	struct dhcpOfferedAddr static_lease;
-	int max_sock;
-	unsigned long num_ips;
-
+	uint32_t server_id_align = 0, requested_align = 0;
+	uint32_t lease, lease_ip;
 	uint32_t static_lease_ip;
 
-	memset(&server_config, 0, sizeof(struct server_config_t));
-	read_config(argc < 2 ? DHCPD_CONF_FILE : argv[1]);
+	if ((state = get_option(options, DHCP_MESSAGE_TYPE)) == NULL) {
+		DEBUG(LOG_ERR, "couldn't get option from packet, ignoring");
+		return;
+	}
 
-	/* Start the log, sanitize fd's, and write a pid file */
-	start_log_and_pid("udhcpd", server_config.pidfile);
+	/* Look for a static lease */
+	static_lease_ip = getIpByMac(&server_config.static_leases, packet->chaddr);
+
+	if(static_lease_ip)
+	{
+		printf("Found static lease: %x\n", static_lease_ip);
+
+		/* static leases have no entry in the lease table */
+		lease = 0;
+		lease_ip = static_lease_ip;
+	}
+	else
+	{
+	lease = find_lease_by_chaddr(packet->chaddr);
+	lease_ip = lease ? lease_yiaddr(lease) : 0;
+	}
+
+	switch (state[0]) {
+	case DHCPDISCOVER:
+		DEBUG(LOG_INFO,"received DISCOVER");
+
+		if (sendOffer(packet, options) < 0) {
+			LOG(LOG_ERR, "send OFFER failed");
+		}
+		break;
+	case DHCPREQUEST:
+		DEBUG(LOG_INFO, "received REQUEST");
+
+		requested = get_option(options, DHCP_REQUESTED_IP);
+		server_id = get_option(options, DHCP_SERVER_ID);
+
+		if (requested) memcpy(&requested_align, requested, 4);
+		if (server_id) memcpy(&server_id_align, server_id, 4);
+
+		if (lease_ip) {
+			if (server_id) {
+				/* SELECTING State */
+				DEBUG(LOG_INFO, "server_id = %08x", ntohl(server_id_align));
+				if (server_id_align == server_config.server && requested &&
+				    requested_align == lease_ip) {
+					sendACK(packet, options, lease_ip);
+				}
+			} else {
+				if (requested) {
+					/* INIT-REBOOT State */
+					if (lease_ip == requested_align)
+						sendACK(packet, options, lease_ip);
+					else sendNAK(packet);
+				} else {
+					/* RENEWING or REBINDING State */
+					if (lease_ip == packet->ciaddr)
+						sendACK(packet, options, lease_ip);
+					else {
+						/* don't know what to do!!!! */
+						sendNAK(packet);
+					}
+				}
+			}
+
+		/* what to do if we have no record of the client */
+		} else if (server_id) {
+			/* SELECTING State */
+
+		} else if (requested) {
+			/* INIT-REBOOT State */
+			if ((lease = find_lease_by_yiaddr(requested_align))) {
+				if (lease_expired(lease)) {
+					/* probably best if we drop this lease */
+					clear_lease_chaddr(lease);
+					journal_lease(lease);
+				/* make some contention for this address */
+				} else sendNAK(packet);
+			} else if (ntohl(requested_align) < ntohl(server_config.start) ||
+				   ntohl(requested_align) > ntohl(server_config.end)) {
+				sendNAK(packet);
+			} /* else remain silent */
+
+		} else {
+			 /* RENEWING or REBINDING State */
+		}
+		break;
+	case DHCPDECLINE:
+		DEBUG(LOG_INFO,"received DECLINE");
+		if (lease) {
+			clear_lease_chaddr(lease);
+			set_lease_expires(lease, time(0) + server_config.decline_time);
+			journal_lease(lease);
+		}
+		break;
+	case DHCPRELEASE:
+		DEBUG(LOG_INFO,"received RELEASE");
+		if (lease) {
+			set_lease_expires(lease, time(0));
+			journal_lease(lease);
+		}
+		break;
+	case DHCPINFORM:
+		DEBUG(LOG_INFO,"received INFORM");
+		send_inform(packet);
+		break;
+	default:
+		LOG(LOG_WARNING, "unsupported DHCP message (%02x) -- ignoring", state[0]);
+	}
+}
+
+
+/* make config the interface being served */
+static void select_config(struct server_config_t *config)
+{
+	cur_config = config;
+	select_lease_table(config->leases);
+}
+
+
+/* get the current interface's pool and lease table ready, -1 if the interface can't be used */
+static int setup_interface(void)
+{
+	struct option_set *option;
+	unsigned long num_ips;
 
 	if ((option = find_option(server_config.options, DHCP_LEASE_TIME))) {
 		memcpy(&server_config.lease, option->data + 2, 4);
@@ -96,178 +203,185 @@ int main(int argc, char *argv[])
 		server_config.max_leases = num_ips;
 	}
 
-	leases = xcalloc(server_config.max_leases, sizeof(struct dhcpOfferedAddr));
-	read_leases(server_config.lease_file);
-
+	/* workers copy the config, it has to be complete by now */
 	if (read_interface(server_config.interface, &server_config.ifindex,
 			   &server_config.server, server_config.arp) < 0)
-		return 1;
+		return -1;
+	encode_replies();
+
+	if (server_config.workers) {
+		setup_shards();
+		read_leases(server_config.lease_file);
+	} else if (!init_lease_table())
+		read_leases(server_config.lease_file);
+	open_journal();
+	return 0;
+}
+
+
+/* read and handle whatever is queued on the current interface's (or
+ * worker's) socket */
+static void serve_interface(void)
+{
+	static __thread struct dhcpMessage packets[RECV_BATCH];
+	static __thread struct option_index options[RECV_BATCH];
+	int bytes[RECV_BATCH];
+	int count, i;
+
+#ifdef UDHCP_IO_URING
+	/* the ring has already received them, handle them where they are */
+	if (uring_active() && uring_ready(server_config.socket)) {
+		struct dhcpMessage *received[RECV_BATCH];
+
+		while ((count = get_ring_packets(received, options, bytes, RECV_BATCH,
+							 server_config.socket)) > 0) {
+			for (i = 0; i < count; i++)
+				if (bytes[i] >= 0) handle_packet(received[i], &options[i]);
+			flush_packets();
+			uring_recycle();
+		}
+		if (count < 0) {
+			DEBUG(LOG_INFO, "error on read, %m, reopening socket");
+			close(server_config.socket);
+			server_config.socket = -1;
+		}
+		return;
+	}
+#endif
+
+	if ((count = get_packets(packets, options, bytes, RECV_BATCH, server_config.socket)) < 0) {
+		if (errno == EINTR) return;
+		/* a worker's socket has to keep its place in the steering group,
+		 * the server gives up if it keeps failing instead */
+		if (server_config.shard) server_config.shard->read_errors++;
+		else {
+			DEBUG(LOG_INFO, "error on read, %m, reopening socket");
+			close(server_config.socket);
+			server_config.socket = -1;
+		}
+		return;
+	}
+	if (server_config.shard) server_config.shard->read_errors = 0;
+
+	/* handle everything that was queued, in the order it arrived */
+	for (i = 0; i < count; i++)
+		if (bytes[i] >= 0) handle_packet(&packets[i], &options[i]);
+	flush_packets();
+}
+
+
+#ifdef COMBINED_BINARY
+int udhcpd_main(int argc, char *argv[])
+#else
+int main(int argc, char *argv[])
+#endif
+{
+	struct server_config_t *config;
+	unsigned long auto_time;
+	int retval;
+
+	read_config(argc < 2 ? DHCPD_CONF_FILE : argv[1]);
+
+	/* Start the log, sanitize fd's, and write a pid file */
+	start_log_and_pid("udhcpd", server_configs->pidfile);
+
+	for (config = server_configs; config; config = config->next) {
+		cur_config = config;
+		if (setup_interface() < 0)
+			return 1;
+	}
 
 #ifndef UDHCP_DEBUG
-	background(server_config.pidfile); /* hold lock during fork. */
+	background(server_configs->pidfile); /* hold lock during fork. */
 #endif
 
-	/* Setup the signal pipe */
-	udhcp_sp_setup();
+	/* Setup the event loop, the workers started after it leave the signals to it */
+	udhcp_ev_setup();
 
-	timeout_end = time(0) + server_config.auto_time;
-	while(1) { /* loop until universe collapses */
+	/* with a ring, the loop waits on it instead of the listen sockets */
+	if ((retval = uring_setup()) >= 0)
+		udhcp_ev_add(retval);
 
-		if (server_socket < 0)
-			if ((server_socket = listen_socket(INADDR_ANY, SERVER_PORT, server_config.interface)) < 0) {
-				LOG(LOG_ERR, "FATAL: couldn't create server socket, %m");
+	for (config = server_configs; config; config = config->next)
+		if (config->workers) {
+			cur_config = config;
+			if (start_workers(serve_interface) < 0) {
+				LOG(LOG_ERR, "FATAL: couldn't start the workers of %s, %m", config->interface);
 				return 2;
 			}
-
-		max_sock = udhcp_sp_fd_set(&rfds, server_socket);
-		if (server_config.auto_time) {
-			tv.tv_sec = timeout_end - time(0);
-			tv.tv_usec = 0;
 		}
-		if (!server_config.auto_time || tv.tv_sec > 0) {
-			retval = select(max_sock + 1, &rfds, NULL, NULL,
-					server_config.auto_time ? &tv : NULL);
-		} else retval = 0; /* If we already timed out, fall through */
-
-		if (retval == 0) {
-			write_leases();
-			timeout_end = time(0) + server_config.auto_time;
+
+	/* the lease files of every interface are written on the first one's timer */
+	auto_time = server_configs->auto_time;
+	udhcp_ev_timer(auto_time ? (long) auto_time : -1);
+	while(1) { /* loop until universe collapses */
+
+		for (config = server_configs; config; config = config->next)
+			if (config->socket < 0 && !config->workers) {
+				if ((config->socket = listen_socket(INADDR_ANY, SERVER_PORT, config->interface, 0)) < 0) {
+					LOG(LOG_ERR, "FATAL: couldn't create server socket, %m");
+					return 2;
+				}
+				if (!uring_active()) udhcp_ev_add(config->socket);
+				else if (uring_listen(config->socket) < 0) {
+					LOG(LOG_WARNING, "couldn't receive on %s with io_uring, %m, "
+						"using recvmmsg", config->interface);
+					udhcp_ev_add(config->socket);
+				}
+			}
+
+		if ((retval = udhcp_ev_wait()) == 0) {
+			/* a lease store never needs writing out, with a journal
+			 * only rewrite the lease file if something changed */
+			for (config = server_configs; config; config = config->next) {
+				select_config(config);
+				lock_shards();
+				if (server_config.lease_store) sync_lease_store();
+				else if (!journal_empty()) write_leases();
+				unlock_shards();
+			}
+			udhcp_ev_timer(auto_time);
 			continue;
-		} else if (retval < 0 && errno != EINTR) {
-			DEBUG(LOG_INFO, "error on select");
+		} else if (retval < 0) {
+			if (errno != EINTR) DEBUG(LOG_INFO, "error on epoll_wait");
 			continue;
 		}
 
-		switch (udhcp_sp_read(&rfds)) {
+		switch (udhcp_ev_signal()) {
 		case SIGUSR1:
 			LOG(LOG_INFO, "Received a SIGUSR1");
-			write_leases();
+			for (config = server_configs; config; config = config->next) {
+				select_config(config);
+				lock_shards();
+				write_leases();
+				unlock_shards();
+			}
 			/* why not just reset the timeout, eh */
-			timeout_end = time(0) + server_config.auto_time;
+			if (auto_time) udhcp_ev_timer(auto_time);
 			continue;
 		case SIGTERM:
 			LOG(LOG_INFO, "Received a SIGTERM");
-			return 0;
-		case 0: break;		/* no signal */
-		default: continue;	/* signal or error (probably EINTR) */
-		}
-
-		if ((bytes = get_packet(&packet, server_socket)) < 0) { /* this waits for a packet - idle */
-			if (bytes == -1 && errno != EINTR) {
-				DEBUG(LOG_INFO, "error on read, %m, reopening socket");
-				close(server_socket);
-				server_socket = -1;
+			/* the workers are stopped between batches for good */
+			for (config = server_configs; config; config = config->next) {
+				select_config(config);
+				lock_shards();
+				if (server_config.lease_store) sync_lease_store();
 			}
+			reap_notify(1);
+			return 0;
+		case SIGCHLD:
+			reap_notify(0);
 			continue;
+		case 0: break;		/* no signal */
+		default: continue;	/* signal or error */
 		}
 
-		if ((state = get_option(&packet, DHCP_MESSAGE_TYPE)) == NULL) {
-			DEBUG(LOG_ERR, "couldn't get option from packet, ignoring");
-			continue;
-		}
-
-		/* Look for a static lease */
-		static_lease_ip = getIpByMac(server_config.static_leases, &packet.chaddr);
-
-		if(static_lease_ip)
-		{
-			printf("Found static lease: %x\n", static_lease_ip);
-
-			memcpy(&static_lease.chaddr, &packet.chaddr, 16);
-			static_lease.yiaddr = static_lease_ip;
-			static_lease.expires = 0;
-
-			lease = &static_lease;
-
-		}
-		else
-		{
-		lease = find_lease_by_chaddr(packet.chaddr);
-		}
-
-		switch (state[0]) {
-		case DHCPDISCOVER:
-			DEBUG(LOG_INFO,"received DISCOVER");
-
-			if (sendOffer(&packet) < 0) {
-				LOG(LOG_ERR, "send OFFER failed");
-			}
-			break;
-		case DHCPREQUEST:
-			DEBUG(LOG_INFO, "received REQUEST");
-
-			requested = get_option(&packet, DHCP_REQUESTED_IP);
-			server_id = get_option(&packet, DHCP_SERVER_ID);
-
-			if (requested) memcpy(&requested_align, requested, 4);
-			if (server_id) memcpy(&server_id_align, server_id, 4);
-
-			if (lease) {
-				if (server_id) {
-					/* SELECTING State */
-					DEBUG(LOG_INFO, "server_id = %08x", ntohl(server_id_align));
-					if (server_id_align == server_config.server && requested &&
-					    requested_align == lease->yiaddr) {
-						sendACK(&packet, lease->yiaddr);
-					}
-				} else {
-					if (requested) {
-						/* INIT-REBOOT State */
-						if (lease->yiaddr == requested_align)
-							sendACK(&packet, lease->yiaddr);
-						else sendNAK(&packet);
-					} else {
-						/* RENEWING or REBINDING State */
-						if (lease->yiaddr == packet.ciaddr)
-							sendACK(&packet, lease->yiaddr);
-						else {
-							/* don't know what to do!!!! */
-							sendNAK(&packet);
-						}
-					}
-				}
-
-			/* what to do if we have no record of the client */
-			} else if (server_id) {
-				/* SELECTING State */
-
-			} else if (requested) {
-				/* INIT-REBOOT State */
-				if ((lease = find_lease_by_yiaddr(requested_align))) {
-					if (lease_expired(lease)) {
-						/* probably best if we drop this lease */
-						memset(lease->chaddr, 0, 16);
-					/* make some contention for this address */
-					} else sendNAK(&packet);
-				} else if (requested_align < server_config.start ||
-					   requested_align > server_config.end) {
-					sendNAK(&packet);
-				} /* else remain silent */
-
-			} else {
-				 /* RENEWING or REBINDING State */
+		for (config = server_configs; config; config = config->next)
+			if (udhcp_ev_ready(config->socket) || (uring_active() && uring_ready(config->socket))) {
+				select_config(config);
+				serve_interface();
 			}
-			break;
-		case DHCPDECLINE:
-			DEBUG(LOG_INFO,"received DECLINE");
-			if (lease) {
-				memset(lease->chaddr, 0, 16);
-				lease->expires = time(0) + server_config.decline_time;
-			}
-			break;
-		case DHCPRELEASE:
-			DEBUG(LOG_INFO,"received RELEASE");
-			if (lease) lease->expires = time(0);
-			break;
-		case DHCPINFORM:
-			DEBUG(LOG_INFO,"received INFORM");
-			send_inform(&packet);
-			break;
-		default:
-			LOG(LOG_WARNING, "unsupported DHCP message (%02x) -- ignoring", state[0]);
-		}
 	}
 
 	return 0;
 }
-
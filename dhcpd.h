@@ -4,6 +4,7 @@
 
 #include <netinet/ip.h>
 #include <netinet/udp.h>
+#include <sys/types.h>
 
 #include "libbb_udhcp.h"
 #include "leases.h"
@@ -20,6 +21,9 @@
 /* where to find the DHCP server configuration file */
 #define DHCPD_CONF_FILE         "/etc/udhcpd.conf"
 
+/* how many queued packets to read from the socket at a time */
+#define RECV_BATCH		32
+
 /*****************************************************************/
 /* Do not modify below here unless you know what you are doing!! */
 /*****************************************************************/
@@ -100,12 +104,31 @@ struct option_set {
 	struct option_set *next;
 };
 
+/* The options of one kind of reply, encoded once the config is loaded:
+ * the message type, server id, lease time and the configured options */
+struct reply_options {
+	uint8_t options[308];
+	int length;			/* up to and including the end option */
+	int lease_time;			/* where the lease time goes, 0 if there is none */
+};
+
 struct static_lease {
-	uint8_t *mac;
-	uint32_t *ip;
-	struct static_lease *next;
+	struct static_lease *next;	/* next lease, in config file order */
+	struct static_lease *mac_next;	/* next lease on the same mac hash chain */
+	uint32_t ip;
+	uint8_t mac[6];
 };
 
+struct static_lease_table {
+	struct static_lease *list;
+	struct static_lease *last;
+	struct static_lease **by_mac;	/* hash chains, newest lease first */
+	unsigned int count;
+	unsigned int mask;		/* hash table size - 1 */
+};
+
+struct shard;
+
 struct server_config_t {
 	uint32_t server;		/* Our IP, in network order */
 	uint32_t start;			/* Start address of leases, network order */
@@ -125,17 +148,41 @@ struct server_config_t {
 	unsigned long conflict_time;	/* how long an arp conflict offender is leased for */
 	unsigned long offer_time;	/* how long an offered address is reserved */
 	unsigned long min_lease;	/* minimum lease a client can request*/
+	unsigned long workers;		/* threads serving the interface, 0 to serve it from the main loop */
 	char *lease_file;
 	char *pidfile;
 	char *notify_file;		/* What to run whenever leases are written */
+	char *journal_file;		/* Where to log lease changes between writes, "" for none */
+	char *lease_store;		/* File to keep the lease table mapped in, "" for none */
+	char sync_store;		/* flush the lease store on every change */
+	char versioned_leases;		/* write the lease file with a header and checksums */
+	char lease_index;		/* and with indexes sorted by ip and mac */
 	uint32_t siaddr;		/* next server bootp option */
 	char *sname;			/* bootp server name */
 	char *boot_file;		/* bootp boot file option */
-	struct static_lease *static_leases; /* List of ip/mac pairs to assign static leases */
+	struct static_lease_table static_leases; /* ip/mac pairs to assign static leases */
+	struct reply_options offer_options;
+	struct reply_options ack_options;
+	struct reply_options inform_options;
+	struct reply_options nak_options;
+
+	/* what is being served on the interface */
+	int socket;			/* listen socket, -1 until it is opened */
+	struct lease_table *leases;
+	int journal_fd;
+	unsigned long journal_records;
+	int journal_unsynced;		/* records were appended since the last fdatasync() */
+	pid_t notify_pid;		/* notify_file while it runs */
+	int notify_pending;		/* leases were written while it ran */
+	struct shard *shards;		/* with workers, the shards of the pool they serve */
+	struct shard *shard;		/* in a worker's copy of the config, its shard */
+	struct server_config_t *next;	/* next interface, in config file order */
 };
 
-extern struct server_config_t server_config;
-extern struct dhcpOfferedAddr *leases;
+/* one config per interface, server_config is the one this thread is serving */
+extern struct server_config_t *server_configs;
+extern __thread struct server_config_t *cur_config;
+#define server_config (*cur_config)
 
 
 #endif
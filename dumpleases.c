@@ -4,6 +4,7 @@
  */
 #include <fcntl.h>
 #include <string.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/wait.h>
@@ -18,20 +19,40 @@
 
 #include "dhcpd.h"
 #include "leases.h"
+#include "leasefile.h"
 #include "libbb_udhcp.h"
 
 #define REMAINING 0
 #define ABSOLUTE 1
 
+#define FORMAT_TEXT	0
+#define FORMAT_CSV	1
+#define FORMAT_JSON	2
+
+#define SORT_NONE	0
+#define SORT_IP		1
+#define SORT_MAC	2
+#define SORT_EXPIRES	3
+
+#define SUMMARY_NONE	0
+#define SUMMARY_SUBNET	1
+#define SUMMARY_EXPIRY	2
+
 
 #ifndef IN_BUSYBOX
 static void ATTRIBUTE_NORETURN show_usage(void)
 {
 	printf(
-"Usage: dumpleases -f <file> -[r|a]\n\n"
+"Usage: dumpleases -f <file> -[r|a] [filters] [-s <key>] [-o <format>] [-S <summary>]\n\n"
 "  -f, --file=FILENAME             Leases file to load\n"
 "  -r, --remaining                 Interepret lease times as time remaing\n"
-"  -a, --absolute                  Interepret lease times as expire time\n");
+"  -a, --absolute                  Interepret lease times as expire time\n"
+"  -m, --mac=PREFIX                Only leases whose MAC starts with PREFIX\n"
+"  -i, --ip=FIRST[-LAST]|NET/BITS  Only leases in an IP range\n"
+"  -e, --expiring=SECONDS          Only leases running out within SECONDS\n"
+"  -s, --sort=ip|mac|expires       Sort the leases\n"
+"  -o, --format=text|csv|json      Output format\n"
+"  -S, --summary=subnet|expiry     Leases per /24, or a histogram of expiry times\n");
 	exit(0);
 }
 #else
@@ -39,29 +60,385 @@ static void ATTRIBUTE_NORETURN show_usage(void)
 #endif
 
 
+static int mode = REMAINING;
+static int format = FORMAT_TEXT;
+static struct leasefile lf;
+static time_t now;
+
+/* which leases to show */
+static uint8_t mac_prefix[16];
+static int mac_prefix_len;
+static uint32_t ip_first, ip_last = 0xFFFFFFFF;	/* host order */
+static long expiring = -1;
+
+
+/* when a lease runs out, and how long it has left (0 once expired) */
+static void lease_times(struct dhcpOfferedAddr *lease, time_t *expires, long *remaining)
+{
+	long value = ntohl(lease->expires);
+
+	if (lf.header) {
+		/* versioned lease files count from when they were written */
+		*expires = (time_t) ntohl(lf.header->time_base) + value;
+		*remaining = value ? *expires - now : 0;
+	} else if (mode == REMAINING) {
+		*expires = now + value;
+		*remaining = value;
+	} else {
+		*expires = value;
+		*remaining = value - now;
+	}
+	if (*remaining < 0) *remaining = 0;
+}
+
+
+static int parse_mac_prefix(const char *arg)
+{
+	char *end;
+
+	for (mac_prefix_len = 0; *arg && mac_prefix_len < 16; mac_prefix_len++) {
+		mac_prefix[mac_prefix_len] = strtoul(arg, &end, 16);
+		if (end == arg || end - arg > 2 || (*end && *end != ':' && *end != '-'))
+			return 0;
+		arg = *end ? end + 1 : end;
+	}
+	return !*arg;
+}
+
+
+/* FIRST, FIRST-LAST or NET/BITS */
+static int parse_ip_range(char *arg)
+{
+	struct in_addr addr;
+	char *sep;
+	int bits;
+
+	if ((sep = strchr(arg, '/'))) {
+		*sep++ = '\0';
+		bits = atoi(sep);
+		if (!inet_aton(arg, &addr) || bits < 0 || bits > 32) return 0;
+		ip_first = ntohl(addr.s_addr) & (bits ? ~0U << (32 - bits) : 0);
+		ip_last = ip_first | (bits ? ~(~0U << (32 - bits)) : ~0U);
+		return 1;
+	}
+	if ((sep = strchr(arg, '-'))) *sep++ = '\0';
+	if (!inet_aton(arg, &addr)) return 0;
+	ip_first = ip_last = ntohl(addr.s_addr);
+	if (sep) {
+		if (!inet_aton(sep, &addr)) return 0;
+		ip_last = ntohl(addr.s_addr);
+	}
+	return 1;
+}
+
+
+static int lease_wanted(struct dhcpOfferedAddr *lease)
+{
+	uint32_t ip = ntohl(lease->yiaddr);
+	time_t expires;
+	long remaining;
+
+	if (mac_prefix_len && memcmp(lease->chaddr, mac_prefix, mac_prefix_len)) return 0;
+	if (ip < ip_first || ip > ip_last) return 0;
+	if (expiring >= 0) {
+		lease_times(lease, &expires, &remaining);
+		if (!remaining || remaining > expiring) return 0;
+	}
+	return 1;
+}
+
+
+/* Leases are formatted by hand into a line buffer and written a line at
+ * a time, rather than through printf, inet_ntoa and ctime for every field. */
+static const char hex[] = "0123456789abcdef";
+
+static char *put_mac(char *p, uint8_t *mac)
+{
+	int i;
+
+	for (i = 0; i < 6; i++) {
+		*p++ = hex[mac[i] >> 4];
+		*p++ = hex[mac[i] & 0xF];
+		if (i != 5) *p++ = ':';
+	}
+	return p;
+}
+
+
+static char *put_ulong(char *p, unsigned long n)
+{
+	char buf[24], *q = buf + sizeof(buf);
+
+	do *--q = '0' + n % 10; while (n /= 10);
+	memcpy(p, q, buf + sizeof(buf) - q);
+	return p + (buf + sizeof(buf) - q);
+}
+
+
+static char *put_ip(char *p, uint32_t ip)
+{
+	uint8_t *b = (uint8_t *) &ip;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		p = put_ulong(p, b[i]);
+		if (i != 3) *p++ = '.';
+	}
+	return p;
+}
+
+
+static char *put_str(char *p, const char *s)
+{
+	size_t len = strlen(s);
+
+	memcpy(p, s, len);
+	return p + len;
+}
+
+
+/* "3 days, 2 hours, 1 minutes, 10 seconds" */
+static char *put_remaining(char *p, long remaining)
+{
+	if (!remaining) return put_str(p, "expired");
+	if (remaining > 60*60*24) {
+		p = put_str(put_ulong(p, remaining / (60*60*24)), " days, ");
+		remaining %= 60*60*24;
+	}
+	if (remaining > 60*60) {
+		p = put_str(put_ulong(p, remaining / (60*60)), " hours, ");
+		remaining %= 60*60;
+	}
+	if (remaining > 60) {
+		p = put_str(put_ulong(p, remaining / 60), " minutes, ");
+		remaining %= 60;
+	}
+	return put_str(put_ulong(p, remaining), " seconds");
+}
+
+
+static void print_lease(struct dhcpOfferedAddr *lease, int first)
+{
+	char line[128], *p = line;
+	time_t expires;
+	long remaining;
+	struct tm tm;
+
+	lease_times(lease, &expires, &remaining);
+
+	switch (format) {
+	case FORMAT_TEXT:
+		/*     "00:00:00:00:00:00 255.255.255.255 Wed Jun 30 21:49:08 1993" */
+		p = put_mac(p, lease->chaddr);
+		*p++ = ' ';
+		p = put_ip(p, lease->yiaddr);
+		while (p - line < 34) *p++ = ' ';
+		if (mode == REMAINING) p = put_remaining(p, remaining);
+		else {
+			localtime_r(&expires, &tm);
+			p += strftime(p, 32, "%a %b %e %H:%M:%S %Y", &tm);
+		}
+		break;
+	case FORMAT_CSV:
+		p = put_mac(p, lease->chaddr);
+		p = put_ip(put_str(p, ","), lease->yiaddr);
+		p = put_ulong(put_str(p, ","), expires);
+		p = put_ulong(put_str(p, ","), remaining);
+		break;
+	case FORMAT_JSON:
+		p = put_str(p, first ? "{\"mac\":\"" : ",{\"mac\":\"");
+		p = put_mac(p, lease->chaddr);
+		p = put_ip(put_str(p, "\",\"ip\":\""), lease->yiaddr);
+		p = put_ulong(put_str(p, "\",\"expires\":"), expires);
+		p = put_ulong(put_str(p, ",\"remaining\":"), remaining);
+		*p++ = '}';
+		break;
+	}
+	*p++ = '\n';
+	fwrite(line, 1, p - line, stdout);
+}
+
+
+static void print_leases(struct dhcpOfferedAddr **list, uint32_t count)
+{
+	uint32_t i;
+
+	if (format == FORMAT_TEXT)
+		printf("Mac Address       IP-Address      Expires %s\n", mode == REMAINING ? "in" : "at");
+	else if (format == FORMAT_CSV) printf("mac,ip,expires,remaining\n");
+	else printf("[\n");
+
+	for (i = 0; i < count; i++) print_lease(list[i], !i);
+
+	if (format == FORMAT_JSON) printf("]\n");
+}
+
+
+/* leases per /24, counted into a small open addressing table */
+struct subnet_count {
+	uint32_t net;		/* host order, 0 for an empty slot (0.0.0.0/24 is never leased) */
+	uint32_t leases;
+	uint32_t active;
+};
+
+static int cmp_subnet(const void *a, const void *b)
+{
+	uint32_t x = ((const struct subnet_count *) a)->net;
+	uint32_t y = ((const struct subnet_count *) b)->net;
+
+	return x < y ? -1 : x > y;
+}
+
+
+static void summary_subnet(struct dhcpOfferedAddr **list, uint32_t count)
+{
+	struct subnet_count *table;
+	uint32_t mask, i, j, nets = 0, net;
+	struct in_addr addr;
+	time_t expires;
+	long remaining;
+	double used;
+
+	for (mask = 15; mask < 2 * count; mask = 2 * mask + 1);
+	table = xcalloc(mask + 1, sizeof(struct subnet_count));
+
+	for (i = 0; i < count; i++) {
+		net = ntohl(list[i]->yiaddr) & 0xFFFFFF00;
+		for (j = (net >> 8) * 2654435761U & mask; table[j].net && table[j].net != net; j = (j + 1) & mask);
+		if (!table[j].net) nets++;
+		table[j].net = net;
+		table[j].leases++;
+		lease_times(list[i], &expires, &remaining);
+		if (remaining) table[j].active++;
+	}
+
+	/* pack the used slots to the front, then put them in order */
+	for (i = j = 0; i <= mask; i++)
+		if (table[i].net) table[j++] = table[i];
+	qsort(table, nets, sizeof(struct subnet_count), cmp_subnet);
+
+	if (format == FORMAT_TEXT) printf("Subnet             Leases   Active   Used\n");
+	else if (format == FORMAT_CSV) printf("subnet,leases,active,utilization\n");
+	else printf("[\n");
+	for (i = 0; i < nets; i++) {
+		addr.s_addr = htonl(table[i].net);
+		used = table[i].active * 100.0 / 254; /* usable addresses in a /24 */
+		if (format == FORMAT_TEXT)
+			printf("%-15s/24 %8u %8u %5.1f%%\n", inet_ntoa(addr), table[i].leases, table[i].active, used);
+		else if (format == FORMAT_CSV)
+			printf("%s/24,%u,%u,%.1f\n", inet_ntoa(addr), table[i].leases, table[i].active, used);
+		else printf("%s{\"subnet\":\"%s/24\",\"leases\":%u,\"active\":%u,\"utilization\":%.1f}\n",
+			    i ? "," : "", inet_ntoa(addr), table[i].leases, table[i].active, used);
+	}
+	if (format == FORMAT_JSON) printf("]\n");
+	free(table);
+}
+
+
+/* how many leases run out within each of a few growing spans of time */
+static void summary_expiry(struct dhcpOfferedAddr **list, uint32_t count)
+{
+	static const struct {
+		const char *name;
+		long upto;
+	} buckets[] = {
+		{"expired",	0},
+		{"1m",		60},
+		{"10m",		10*60},
+		{"1h",		60*60},
+		{"6h",		6*60*60},
+		{"1d",		24*60*60},
+		{"1w",		7*24*60*60},
+		{"more",	0},
+	};
+	const unsigned int nbuckets = sizeof(buckets) / sizeof(buckets[0]);
+	uint32_t hist[sizeof(buckets) / sizeof(buckets[0])] = {0}, i, b;
+	time_t expires;
+	long remaining;
+
+	for (i = 0; i < count; i++) {
+		lease_times(list[i], &expires, &remaining);
+		for (b = 0; b < nbuckets - 1 && remaining > buckets[b].upto; b++);
+		hist[b]++;
+	}
+
+	if (format == FORMAT_TEXT) printf("Expires within  Leases\n");
+	else if (format == FORMAT_CSV) printf("within,leases\n");
+	else printf("[\n");
+	for (b = 0; b < nbuckets; b++) {
+		if (format == FORMAT_TEXT) printf("%-14s %7u\n", buckets[b].name, hist[b]);
+		else if (format == FORMAT_CSV) printf("%s,%u\n", buckets[b].name, hist[b]);
+		else printf("%s{\"within\":\"%s\",\"leases\":%u}\n", b ? "," : "", buckets[b].name, hist[b]);
+	}
+	if (format == FORMAT_JSON) printf("]\n");
+}
+
+
+static int cmp_ip(const void *a, const void *b)
+{
+	uint32_t x = ntohl((*(struct dhcpOfferedAddr * const *) a)->yiaddr);
+	uint32_t y = ntohl((*(struct dhcpOfferedAddr * const *) b)->yiaddr);
+
+	return x < y ? -1 : x > y;
+}
+
+
+static int cmp_mac(const void *a, const void *b)
+{
+	return memcmp((*(struct dhcpOfferedAddr * const *) a)->chaddr,
+		      (*(struct dhcpOfferedAddr * const *) b)->chaddr, 16);
+}
+
+
+/* the order of the records in the file */
+static int cmp_position(const void *a, const void *b)
+{
+	struct dhcpOfferedAddr *x = *(struct dhcpOfferedAddr * const *) a;
+	struct dhcpOfferedAddr *y = *(struct dhcpOfferedAddr * const *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+
+static int cmp_expires(const void *a, const void *b)
+{
+	time_t x, y;
+	long remaining;
+
+	lease_times(*(struct dhcpOfferedAddr * const *) a, &x, &remaining);
+	lease_times(*(struct dhcpOfferedAddr * const *) b, &y, &remaining);
+	return x < y ? -1 : x > y;
+}
+
+
 #ifdef IN_BUSYBOX
 int dumpleases_main(int argc, char *argv[])
 #else
 int main(int argc, char *argv[])
 #endif
 {
-	FILE *fp;
-	int i, c, mode = REMAINING;
-	long expires;
+	int c, sort = SORT_NONE, summary = SUMMARY_NONE;
+	uint32_t n, i, per_block, nblocks, count = 0, *order = NULL, *walk = NULL;
 	const char *file = LEASES_FILE;
-	struct dhcpOfferedAddr lease;
-	struct in_addr addr;
+	struct dhcpOfferedAddr *lease, **list;
+	uint8_t *bad;
 
 	static const struct option options[] = {
 		{"absolute", 0, 0, 'a'},
 		{"remaining", 0, 0, 'r'},
 		{"file", 1, 0, 'f'},
+		{"mac", 1, 0, 'm'},
+		{"ip", 1, 0, 'i'},
+		{"expiring", 1, 0, 'e'},
+		{"sort", 1, 0, 's'},
+		{"format", 1, 0, 'o'},
+		{"summary", 1, 0, 'S'},
 		{0, 0, 0, 0}
 	};
 
 	while (1) {
 		int option_index = 0;
-		c = getopt_long(argc, argv, "arf:", options, &option_index);
+		c = getopt_long(argc, argv, "arf:m:i:e:s:o:S:", options, &option_index);
 		if (c == -1) break;
 
 		switch (c) {
@@ -70,45 +447,98 @@ int main(int argc, char *argv[])
 		case 'f':
 			file = optarg;
 			break;
+		case 'm':
+			if (!parse_mac_prefix(optarg)) show_usage();
+			break;
+		case 'i':
+			if (!parse_ip_range(optarg)) show_usage();
+			break;
+		case 'e':
+			expiring = atol(optarg);
+			break;
+		case 's':
+			if (!strcmp(optarg, "ip")) sort = SORT_IP;
+			else if (!strcmp(optarg, "mac")) sort = SORT_MAC;
+			else if (!strcmp(optarg, "expires")) sort = SORT_EXPIRES;
+			else show_usage();
+			break;
+		case 'o':
+			if (!strcmp(optarg, "text")) format = FORMAT_TEXT;
+			else if (!strcmp(optarg, "csv")) format = FORMAT_CSV;
+			else if (!strcmp(optarg, "json")) format = FORMAT_JSON;
+			else show_usage();
+			break;
+		case 'S':
+			if (!strcmp(optarg, "subnet")) summary = SUMMARY_SUBNET;
+			else if (!strcmp(optarg, "expiry")) summary = SUMMARY_EXPIRY;
+			else show_usage();
+			break;
 		default:
 			show_usage();
 		}
 	}
 
-	fp = xfopen(file, "r");
+	if (leasefile_open(file, &lf) < 0) {
+		if (errno == EBADMSG) fprintf(stderr, "%s: corrupt lease file header\n", file);
+		else perror("could not open input file");
+		exit(EXIT_FAILURE);
+	}
+	now = time(0);
+
+	/* check the blocks once up front, the old format is a single block without a CRC */
+	per_block = lf.header ? ntohl(lf.header->block) : lf.count + 1;
+	nblocks = (lf.count + per_block - 1) / per_block;
+	bad = xcalloc(nblocks + 1, 1);
+	for (i = 0; i < nblocks; i++)
+		if (!leasefile_block_ok(&lf, i)) {
+			bad[i] = 1;
+			fprintf(stderr, "skipping corrupt leases %u to %u\n", i * per_block, (i + 1) * per_block - 1);
+		}
 
-	printf("Mac Address       IP-Address      Expires %s\n", mode == REMAINING ? "in" : "at");
-	/*     "00:00:00:00:00:00 255.255.255.255 Wed Jun 30 21:49:08 1993" */
-	while (fread(&lease, sizeof(lease), 1, fp)) {
+	/* An address range or a mac prefix is a binary search of the file's
+	 * index, the records that match it all follow on from there. The
+	 * index that isn't the one asked to sort on is only walked when the
+	 * records can be put back in file order after. */
+	list = xmalloc((lf.count + 1) * sizeof(struct dhcpOfferedAddr *));
+	if ((ip_first || ip_last != 0xFFFFFFFF) && lf.by_ip && sort != SORT_MAC)
+		walk = lf.by_ip, i = leasefile_seek_ip(&lf, ip_first);
+	else if (mac_prefix_len && lf.by_mac && sort != SORT_IP)
+		walk = lf.by_mac, i = leasefile_seek_mac(&lf, mac_prefix, mac_prefix_len);
 
-		for (i = 0; i < 6; i++) {
-			printf("%02x", lease.chaddr[i]);
-			if (i != 5) printf(":");
+	if (walk) {
+		for (; i < lf.count; i++) {
+			lease = &lf.records[n = ntohl(walk[i])];
+			if (walk == lf.by_ip ? ntohl(lease->yiaddr) > ip_last :
+			    memcmp(lease->chaddr, mac_prefix, mac_prefix_len) != 0)
+				break;
+			if (!bad[n / per_block] && lease_wanted(lease))
+				list[count++] = lease;
 		}
-		addr.s_addr = lease.yiaddr;
-		printf(" %-15s", inet_ntoa(addr));
-		expires = ntohl(lease.expires);
-		printf(" ");
-		if (mode == REMAINING) {
-			if (!expires) printf("expired\n");
-			else {
-				if (expires > 60*60*24) {
-					printf("%ld days, ", expires / (60*60*24));
-					expires %= 60*60*24;
-				}
-				if (expires > 60*60) {
-					printf("%ld hours, ", expires / (60*60));
-					expires %= 60*60;
-				}
-				if (expires > 60) {
-					printf("%ld minutes, ", expires / 60);
-					expires %= 60;
-				}
-				printf("%ld seconds\n", expires);
-			}
-		} else printf("%s", ctime(&expires));
-	}
-	fclose(fp);
+		if ((sort == SORT_IP && walk == lf.by_ip) || (sort == SORT_MAC && walk == lf.by_mac))
+			sort = SORT_NONE;
+		else qsort(list, count, sizeof(*list), cmp_position);
+	} else {
+		/* a single pass over the mapped file picks out the wanted
+		 * leases, in the file's own ip or mac order if it has one */
+		if (sort == SORT_IP && lf.by_ip) order = lf.by_ip, sort = SORT_NONE;
+		if (sort == SORT_MAC && lf.by_mac) order = lf.by_mac, sort = SORT_NONE;
+		for (i = 0; i < lf.count; i++) {
+			n = order ? ntohl(order[i]) : i;
+			if (!bad[n / per_block] && lease_wanted(lease = &lf.records[n]))
+				list[count++] = lease;
+		}
+	}
+
+	if (sort == SORT_IP) qsort(list, count, sizeof(*list), cmp_ip);
+	else if (sort == SORT_MAC) qsort(list, count, sizeof(*list), cmp_mac);
+	else if (sort == SORT_EXPIRES) qsort(list, count, sizeof(*list), cmp_expires);
+
+	if (summary == SUMMARY_SUBNET) summary_subnet(list, count);
+	else if (summary == SUMMARY_EXPIRY) summary_expiry(list, count);
+	else print_leases(list, count);
 
+	free(list);
+	free(bad);
+	leasefile_close(&lf);
 	return 0;
 }
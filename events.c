@@ -0,0 +1,158 @@
+/* events.c
+ *
+ * Event loop core shared by the client and the server: any number of
+ * descriptors on one epoll instance, signals read from a signalfd
+ * instead of being caught, and a single timer.
+ *
+ * Licensed under the GPL v2 or later, see the file LICENSE in this tarball.
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+
+#include "events.h"
+#include "common.h"
+
+#define EV_MAX_READY	32
+
+static int epoll_fd = -1;
+static int signal_fd = -1;
+static sigset_t signals, old_mask;
+
+static struct epoll_event ready[EV_MAX_READY];
+static int nready;
+
+/* when the timer fires in CLOCK_MONOTONIC milliseconds, -1 if it is not set */
+static long long deadline = -1;
+
+
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/* Call this before doing anything else. Blocks the signals the daemons
+ * act on so that they are only delivered through the signalfd */
+void udhcp_ev_setup(void)
+{
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR1);
+	sigaddset(&signals, SIGUSR2);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &signals, &old_mask);
+
+	if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+	    (signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC)) < 0 ||
+	    udhcp_ev_add(signal_fd) < 0)
+		LOG(LOG_ERR, "Could not set up the event loop: %m");
+}
+
+
+/* Undo the signal blocking in a child that is about to exec */
+void udhcp_ev_child(void)
+{
+	sigprocmask(SIG_SETMASK, &old_mask, NULL);
+}
+
+
+/* The signal mask from before udhcp_ev_setup(), for posix_spawnattr_setsigmask() */
+void udhcp_ev_sigmask(sigset_t *mask)
+{
+	*mask = old_mask;
+}
+
+
+/* Watch fd for reading. A descriptor that is closed drops out by itself */
+int udhcp_ev_add(int fd)
+{
+	struct epoll_event ev;
+
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+
+void udhcp_ev_del(int fd)
+{
+	struct epoll_event ev;
+	int i;
+
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, &ev);
+	for (i = 0; i < nready; i++)
+		if (ready[i].data.fd == fd) ready[i].data.fd = -1;
+}
+
+
+/* Fire the timer seconds from now (right away if seconds <= 0). A
+ * negative value disarms it */
+void udhcp_ev_timer(long seconds)
+{
+	if (seconds < 0) deadline = -1;
+	else deadline = now_ms() + (long long) seconds * 1000;
+}
+
+
+/* Wait for something to happen. Returns the number of ready descriptors
+ * (the signalfd included), 0 if the timer fired, which disarms it, and
+ * -1 on error */
+int udhcp_ev_wait(void)
+{
+	long long left = 0;
+
+	do {
+		if (deadline >= 0 && (left = deadline - now_ms()) <= 0) {
+			deadline = -1;
+			nready = 0;
+			return 0;
+		}
+		nready = epoll_wait(epoll_fd, ready, EV_MAX_READY,
+				    deadline < 0 ? -1 : left > INT_MAX ? INT_MAX : (int) left);
+	} while (!nready);
+
+	if (nready < 0) {
+		nready = 0;
+		return -1;
+	}
+	return nready;
+}
+
+
+/* true if fd was ready on the last udhcp_ev_wait() */
+int udhcp_ev_ready(int fd)
+{
+	int i;
+
+	if (fd < 0) return 0;
+	for (i = 0; i < nready; i++)
+		if (ready[i].data.fd == fd) return 1;
+	return 0;
+}
+
+
+/* Read a signal from the signalfd. Returns 0 if there is no signal,
+ * -1 on error (and sets errno appropriately), and your signal on success */
+int udhcp_ev_signal(void)
+{
+	struct signalfd_siginfo info;
+
+	if (!udhcp_ev_ready(signal_fd))
+		return 0;
+
+	if (read(signal_fd, &info, sizeof(info)) != sizeof(info))
+		return -1;
+
+	return info.ssi_signo;
+}
@@ -0,0 +1,17 @@
+/* events.h */
+#ifndef _EVENTS_H
+#define _EVENTS_H
+
+#include <signal.h>
+
+void udhcp_ev_setup(void);
+void udhcp_ev_child(void);
+void udhcp_ev_sigmask(sigset_t *mask);
+int udhcp_ev_add(int fd);
+void udhcp_ev_del(int fd);
+void udhcp_ev_timer(long seconds);
+int udhcp_ev_wait(void);
+int udhcp_ev_ready(int fd);
+int udhcp_ev_signal(void);
+
+#endif
@@ -10,6 +10,11 @@
 #include <time.h>
 #include <ctype.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <spawn.h>
+#include <sys/wait.h>
 
 #include <netinet/ether.h>
 #include "static_leases.h"
@@ -17,6 +22,9 @@
 #include "dhcpd.h"
 #include "options.h"
 #include "files.h"
+#include "leasefile.h"
+#include "events.h"
+#include "workers.h"
 #include "common.h"
 
 /*
@@ -156,11 +164,7 @@ static int read_opt(const char *const_line, void *arg)
 	line = (char *) const_line;
 	if (!(opt = strtok(line, " \t="))) return 0;
 
-	for (option = dhcp_options; option->code; option++)
-		if (!strcasecmp(option->name, opt))
-			break;
-
-	if (!option->code) return 0;
+	if (!(option = option_by_name(opt))) return 0;
 
 	do {
 		if (!(val = strtok(NULL, ", \t"))) break;
@@ -222,22 +226,17 @@ static int read_staticlease(const char *const_line, void *arg)
 	char *line;
 	char *mac_string;
 	char *ip_string;
-	uint8_t *mac_bytes;
-	uint32_t *ip;
-
-
-	/* Allocate memory for addresses */
-	mac_bytes = xmalloc(sizeof(unsigned char) * 8);
-	ip = xmalloc(sizeof(uint32_t));
+	uint8_t mac_bytes[6];
+	uint32_t ip;
 
 	/* Read mac */
 	line = (char *) const_line;
-	mac_string = strtok(line, " \t");
-	read_mac(mac_string, mac_bytes);
+	if (!(mac_string = strtok(line, " \t")) || !read_mac(mac_string, mac_bytes))
+		return 0;
 
 	/* Read ip */
-	ip_string = strtok(NULL, " \t");
-	read_ip(ip_string, ip);
+	if (!(ip_string = strtok(NULL, " \t")) || !read_ip(ip_string, &ip))
+		return 0;
 
 	addStaticLease(arg, mac_bytes, ip);
 
@@ -250,32 +249,85 @@ static int read_staticlease(const char *const_line, void *arg)
 }
 
 
+/* where a keyword's variable is in a struct server_config_t */
+#define CONFIG(field)	offsetof(struct server_config_t, field)
+
 static const struct config_keyword keywords[] = {
-	/* keyword	handler   variable address		default */
-	{"start",	read_ip,  &(server_config.start),	"192.168.0.20"},
-	{"end",		read_ip,  &(server_config.end),		"192.168.0.254"},
-	{"interface",	read_str, &(server_config.interface),	"eth0"},
-	{"option",	read_opt, &(server_config.options),	""},
-	{"opt",		read_opt, &(server_config.options),	""},
-	{"max_leases",	read_u32, &(server_config.max_leases),	"254"},
-	{"remaining",	read_yn,  &(server_config.remaining),	"yes"},
-	{"auto_time",	read_u32, &(server_config.auto_time),	"7200"},
-	{"decline_time",read_u32, &(server_config.decline_time),"3600"},
-	{"conflict_time",read_u32,&(server_config.conflict_time),"3600"},
-	{"offer_time",	read_u32, &(server_config.offer_time),	"60"},
-	{"min_lease",	read_u32, &(server_config.min_lease),	"60"},
-	{"lease_file",	read_str, &(server_config.lease_file),	LEASES_FILE},
-	{"pidfile",	read_str, &(server_config.pidfile),	"/var/run/udhcpd.pid"},
-	{"notify_file", read_str, &(server_config.notify_file),	""},
-	{"siaddr",	read_ip,  &(server_config.siaddr),	"0.0.0.0"},
-	{"sname",	read_str, &(server_config.sname),	""},
-	{"boot_file",	read_str, &(server_config.boot_file),	""},
-	{"static_lease",read_staticlease, &(server_config.static_leases),	""},
+	/* keyword	handler   variable			default */
+	{"start",	read_ip,  CONFIG(start),	"192.168.0.20"},
+	{"end",		read_ip,  CONFIG(end),		"192.168.0.254"},
+	{"interface",	read_str, CONFIG(interface),	"eth0"},
+	{"option",	read_opt, CONFIG(options),	""},
+	{"opt",		read_opt, CONFIG(options),	""},
+	{"max_leases",	read_u32, CONFIG(max_leases),	"254"},
+	{"remaining",	read_yn,  CONFIG(remaining),	"yes"},
+	{"auto_time",	read_u32, CONFIG(auto_time),	"7200"},
+	{"decline_time",read_u32, CONFIG(decline_time),"3600"},
+	{"conflict_time",read_u32,CONFIG(conflict_time),"3600"},
+	{"offer_time",	read_u32, CONFIG(offer_time),	"60"},
+	{"min_lease",	read_u32, CONFIG(min_lease),	"60"},
+	{"workers",	read_u32, CONFIG(workers),	"0"},
+	{"lease_file",	read_str, CONFIG(lease_file),	LEASES_FILE},
+	{"pidfile",	read_str, CONFIG(pidfile),	"/var/run/udhcpd.pid"},
+	{"notify_file", read_str, CONFIG(notify_file),	""},
+	{"journal_file",read_str, CONFIG(journal_file),	""},
+	{"lease_store",	read_str, CONFIG(lease_store),	""},
+	{"sync_store",	read_yn,  CONFIG(sync_store),	"no"},
+	{"versioned_leases",read_yn, CONFIG(versioned_leases),"no"},
+	{"lease_index",	read_yn,  CONFIG(lease_index),	"no"},
+	{"siaddr",	read_ip,  CONFIG(siaddr),	"0.0.0.0"},
+	{"sname",	read_str, CONFIG(sname),	""},
+	{"boot_file",	read_str, CONFIG(boot_file),	""},
+	{"static_lease",read_staticlease, CONFIG(static_leases),	""},
 	/*ADDME: static lease */
-	{"",		NULL,	  NULL,				""}
+	{"",		NULL,	  0,				""}
 };
 
 
+/* a config for one more interface, with every keyword at its default */
+static struct server_config_t *new_config(void)
+{
+	struct server_config_t *config, **tail;
+	int i;
+
+	config = xcalloc(1, sizeof(struct server_config_t));
+	config->socket = -1;
+	config->journal_fd = -1;
+	for (i = 0; keywords[i].keyword[0]; i++)
+		if (keywords[i].def[0])
+			keywords[i].handler(keywords[i].def, (char *) config + keywords[i].offset);
+
+	for (tail = &server_configs; *tail; tail = &(*tail)->next);
+	*tail = config;
+	return config;
+}
+
+
+/* interfaces can't share a file, one that is used by an earlier interface
+ * gets the interface name tacked on */
+static void unshare_file(struct server_config_t *config, size_t offset)
+{
+	struct server_config_t *other;
+	char **file = (char **) ((char *) config + offset), *other_file, *name;
+
+	if (!*file) return;
+	for (other = server_configs; other != config; other = other->next) {
+		other_file = *(char **) ((char *) other + offset);
+		if (other_file && !strcmp(*file, other_file)) {
+			asprintf(&name, "%s.%s", *file, config->interface);
+			LOG(LOG_WARNING, "%s is used by %s, using %s for %s",
+				*file, other->interface, name, config->interface);
+			free(*file);
+			*file = name;
+			return;
+		}
+	}
+}
+
+
+/* Each interface line after the first starts the block of another
+ * interface, read into a config of its own that starts out at the
+ * defaults. Lines before the first interface line belong to the first. */
 int read_config(const char *file)
 {
 	FILE *in;
@@ -283,11 +335,10 @@ int read_config(const char *file)
 #ifdef UDHCP_DEBUG
 	char orig[READ_CONFIG_BUF_SIZE];
 #endif
-	int i, lm = 0;
+	struct server_config_t *config;
+	int i, lm = 0, interfaces = 0;
 
-	for (i = 0; keywords[i].keyword[0]; i++)
-		if (keywords[i].def[0])
-			keywords[i].handler(keywords[i].def, keywords[i].var);
+	cur_config = config = new_config();
 
 	if (!(in = fopen(file, "r"))) {
 		LOG(LOG_ERR, "unable to open config file: %s", file);
@@ -311,83 +362,301 @@ int read_config(const char *file)
 		for (i = strlen(line); i > 0 && isspace(line[i - 1]); i--);
 		line[i] = '\0';
 
+		if (!strcasecmp(token, "interface") && interfaces++)
+			config = new_config();
+
 		for (i = 0; keywords[i].keyword[0]; i++)
 			if (!strcasecmp(token, keywords[i].keyword))
-				if (!keywords[i].handler(line, keywords[i].var)) {
+				if (!keywords[i].handler(line, (char *) config + keywords[i].offset)) {
 					LOG(LOG_ERR, "Failure parsing line %d of %s", lm, file);
 					DEBUG(LOG_ERR, "unable to parse '%s'", orig);
 					/* reset back to the default value */
-					keywords[i].handler(keywords[i].def, keywords[i].var);
+					keywords[i].handler(keywords[i].def, (char *) config + keywords[i].offset);
 				}
 	}
 	fclose(in);
+
+	for (config = server_configs; config; config = config->next) {
+		/* the store is always up to date, replaying a journal over it on
+		 * startup would bring back leases that have changed since. With
+		 * workers, the store is what gets dropped. */
+		if (config->lease_store && config->journal_file && !config->workers) {
+			LOG(LOG_WARNING, "journal_file can't be used with lease_store, ignoring it");
+			free(config->journal_file);
+			config->journal_file = NULL;
+		}
+		unshare_file(config, CONFIG(lease_file));
+		unshare_file(config, CONFIG(journal_file));
+		unshare_file(config, CONFIG(lease_store));
+	}
 	return 1;
 }
 
 
-void write_leases(void)
+/* Lease journal: every change to a lease is appended to the journal as a
+ * lease file record, and the journal is emptied whenever the lease file
+ * is rewritten. Replaying it over the lease file gives the lease table.
+ * Each interface keeps its journal_fd and journal_records in its config. */
+
+
+/* fill in the lease file record of a lease, with expires counting from
+ * curr if remaining is set (0 once expired) */
+static void lease_record(uint32_t i, struct dhcpOfferedAddr *lease, time_t curr, int remaining)
 {
-	FILE *fp;
-	unsigned int i;
-	char buf[255];
-	time_t curr = time(0);
-	unsigned long tmp_time;
+	get_lease_record(i, lease);
+	if (remaining) {
+		if (lease_expired(i))
+			lease->expires = 0;
+		else lease->expires -= curr;
+	} /* else stick with the time we got */
+	lease->expires = htonl(lease->expires);
+}
+
+
+/* When the lease of a lease file record runs out, host order. Versioned
+ * lease files count from when they were written, unless the clock is not
+ * to be trusted across restarts. */
+static unsigned long record_expires(struct dhcpOfferedAddr *lease, struct leasefile_header *header)
+{
+	unsigned long expires = ntohl(lease->expires);
+
+	if (server_config.remaining) expires += time(0);
+	else if (header) expires += ntohl(header->time_base);
+	return expires;
+}
 
-	if (!(fp = fopen(server_config.lease_file, "w"))) {
-		LOG(LOG_ERR, "Unable to open %s for writing", server_config.lease_file);
+
+/* ADDME: is it a static lease */
+static int record_in_pool(struct dhcpOfferedAddr *lease)
+{
+	return ntohl(lease->yiaddr) >= ntohl(server_config.start) &&
+	       ntohl(lease->yiaddr) <= ntohl(server_config.end);
+}
+
+
+/* add a lease file record to the lease table, 0 if the table is full */
+static uint32_t load_lease(struct dhcpOfferedAddr *lease)
+{
+	select_record_shard(lease->chaddr, lease->yiaddr);
+	return add_lease(lease->chaddr, lease->yiaddr, record_expires(lease, NULL) - time(0));
+}
+
+
+/* notify_file is run in the background, at most one at a time for each
+ * interface. Lease file writes while it runs are folded into one more run
+ * once it is done. */
+extern char **environ;
+
+
+/* run notify_file on the lease file, without a shell */
+static void run_notify(void)
+{
+	char *argv[] = {server_config.notify_file, server_config.lease_file, NULL};
+	posix_spawnattr_t attr;
+	sigset_t mask;
+
+	if (server_config.notify_pid > 0) {
+		server_config.notify_pending = 1;
 		return;
 	}
 
-	for (i = 0; i < server_config.max_leases; i++) {
-		if (leases[i].yiaddr != 0) {
-
-			/* screw with the time in the struct, for easier writing */
-			tmp_time = leases[i].expires;
+	/* the event loop blocks the signals it reads, give them back to the child */
+	posix_spawnattr_init(&attr);
+	udhcp_ev_sigmask(&mask);
+	posix_spawnattr_setsigmask(&attr, &mask);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+	if ((errno = posix_spawnp(&server_config.notify_pid, argv[0], NULL, &attr, argv, environ))) {
+		LOG(LOG_ERR, "Unable to run %s: %m", argv[0]);
+		server_config.notify_pid = 0;
+	}
+	posix_spawnattr_destroy(&attr);
+}
 
-			if (server_config.remaining) {
-				if (lease_expired(&(leases[i])))
-					leases[i].expires = 0;
-				else leases[i].expires -= curr;
-			} /* else stick with the time we got */
-			leases[i].expires = htonl(leases[i].expires);
-			fwrite(&leases[i], sizeof(struct dhcpOfferedAddr), 1, fp);
 
-			/* Then restore it when done. */
-			leases[i].expires = tmp_time;
+/* reap notify_file of every interface on SIGCHLD, running it again if the
+ * leases were written while it ran. With block set, wait until they are
+ * done for good. */
+void reap_notify(int block)
+{
+	struct server_config_t *current = cur_config;
+
+	for (cur_config = server_configs; cur_config; cur_config = cur_config->next)
+		while (server_config.notify_pid > 0 &&
+		       waitpid(server_config.notify_pid, NULL, block ? 0 : WNOHANG) != 0) {
+			server_config.notify_pid = 0;
+			if (server_config.notify_pending) {
+				server_config.notify_pending = 0;
+				run_notify();
+			}
 		}
+	cur_config = current;
+}
+
+
+/* With workers, the caller holds the locks of their shards */
+void write_leases(void)
+{
+	FILE *fp;
+	uint32_t i, size = 0, count = 0;
+	unsigned int n;
+	char *file = server_config.lease_file;
+	time_t curr = time(0);
+	struct dhcpOfferedAddr *records;
+	int ret;
+
+	/* with a journal, the old lease file must stay intact until the new one is complete */
+	if (server_config.journal_fd >= 0) {
+		file = xmalloc(strlen(server_config.lease_file) + sizeof(".tmp"));
+		sprintf(file, "%s.tmp", server_config.lease_file);
 	}
-	fclose(fp);
 
-	if (server_config.notify_file) {
-		sprintf(buf, "%s %s", server_config.notify_file, server_config.lease_file);
-		system(buf);
+	if (!(fp = fopen(file, "w"))) {
+		LOG(LOG_ERR, "Unable to open %s for writing", file);
+		goto out;
 	}
+
+	/* the leases of every worker's shard go into the one file */
+	for (n = 0; select_table(n); n++) size += lease_table_size();
+	records = xmalloc((size + 1) * sizeof(struct dhcpOfferedAddr));
+	for (n = 0; select_table(n); n++)
+		for (i = 1; i <= lease_table_size(); i++)
+			if (lease_yiaddr(i) != 0)
+				lease_record(i, &records[count++], curr,
+					     server_config.versioned_leases || server_config.remaining);
+
+	if (server_config.versioned_leases)
+		ret = leasefile_write(fp, records, count, server_config.start, server_config.end,
+				      curr, server_config.lease_index);
+	else ret = fwrite(records, sizeof(struct dhcpOfferedAddr), count, fp) == count ? 0 : -1;
+	free(records);
+	if (ret < 0)
+		LOG(LOG_ERR, "Unable to write %s: %m", file);
+
+	if (server_config.journal_fd >= 0) {
+		if (fflush(fp) || fsync(fileno(fp)) < 0 || ferror(fp)) {
+			LOG(LOG_ERR, "Unable to write %s: %m", file);
+			fclose(fp);
+			goto out;
+		}
+		fclose(fp);
+		if (rename(file, server_config.lease_file) < 0) {
+			LOG(LOG_ERR, "Unable to rename %s: %m", file);
+			goto out;
+		}
+		/* everything in the journal is in the lease file now */
+		ftruncate(server_config.journal_fd, 0);
+		server_config.journal_records = 0;
+		for (n = 0; n < server_config.workers; n++)
+			server_config.shards[n].config.journal_records = 0;
+	} else fclose(fp);
+
+	if (server_config.notify_file) run_notify();
+out:
+	if (file != server_config.lease_file) free(file);
 }
 
 
 void read_leases(const char *file)
 {
-	FILE *fp;
+	struct leasefile lf;
+	struct dhcpOfferedAddr *lease;
 	unsigned int i = 0;
-	struct dhcpOfferedAddr lease;
+	uint32_t n, per_block;
 
-	if (!(fp = fopen(file, "r"))) {
+	if (leasefile_open(file, &lf) < 0) {
 		LOG(LOG_ERR, "Unable to open %s for reading", file);
 		return;
 	}
 
-	while (i < server_config.max_leases && (fread(&lease, sizeof lease, 1, fp) == 1)) {
-		/* ADDME: is it a static lease */
-		if (lease.yiaddr >= server_config.start && lease.yiaddr <= server_config.end) {
-			lease.expires = ntohl(lease.expires);
-			if (!server_config.remaining) lease.expires -= time(0);
-			if (!(add_lease(lease.chaddr, lease.yiaddr, lease.expires))) {
+	/* the lease file is loaded into an empty table, so the records can go
+	 * straight into their slots and be indexed all at once afterwards */
+	per_block = lf.header ? ntohl(lf.header->block) : lf.count;
+	for (n = 0; n < lf.count; n++) {
+		if (!(n % per_block) && !leasefile_block_ok(&lf, n / per_block)) {
+			LOG(LOG_WARNING, "Skipping corrupt leases %u to %u of %s",
+				n, n + per_block - 1, file);
+			n += per_block - 1;
+			continue;
+		}
+		lease = &lf.records[n];
+		if (record_in_pool(lease)) {
+			select_record_shard(lease->chaddr, lease->yiaddr);
+			if (!place_lease(lease->chaddr, lease->yiaddr, record_expires(lease, lf.header))) {
 				LOG(LOG_WARNING, "Too many leases while loading %s\n", file);
 				break;
 			}
 			i++;
 		}
 	}
+	for (n = 0; select_table(n); n++) index_leases();
 	DEBUG(LOG_INFO, "Read %d leases", i);
-	fclose(fp);
+	leasefile_close(&lf);
+}
+
+
+/* replay the journal over the leases read from the lease file, then keep it open for appending */
+void open_journal(void)
+{
+	struct dhcpOfferedAddr lease;
+	int fd;
+
+	if (!server_config.journal_file || !server_config.journal_file[0]) return;
+
+	if ((fd = open(server_config.journal_file, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0) {
+		LOG(LOG_ERR, "Unable to open %s: %m", server_config.journal_file);
+		return;
+	}
+
+	while (read(fd, &lease, sizeof lease) == sizeof lease) {
+		if (record_in_pool(&lease))
+			load_lease(&lease);
+		server_config.journal_records++;
+	}
+	select_lease_table(server_config.leases);
+	DEBUG(LOG_INFO, "Replayed %lu journal records", server_config.journal_records);
+
+	/* a torn record at the end is dropped */
+	ftruncate(fd, server_config.journal_records * sizeof lease);
+	server_config.journal_fd = fd;
+}
+
+
+/* append the new state of a lease to the journal */
+void journal_lease(uint32_t lease)
+{
+	struct dhcpOfferedAddr record;
+
+	if (server_config.journal_fd < 0 || !lease) return;
+
+	lease_record(lease, &record, time(0), server_config.remaining);
+	if (write(server_config.journal_fd, &record, sizeof record) != sizeof record)
+		LOG(LOG_ERR, "Unable to write %s: %m", server_config.journal_file);
+	else {
+		server_config.journal_records++;
+		server_config.journal_unsynced = 1;
+	}
+}
+
+
+/* get the records appended since the last call onto the disk, before the
+ * replies that hand out those leases are sent */
+void sync_journal(void)
+{
+	if (!server_config.journal_unsynced) return;
+	if (fdatasync(server_config.journal_fd) < 0)
+		LOG(LOG_ERR, "Unable to sync %s: %m", server_config.journal_file);
+	server_config.journal_unsynced = 0;
+}
+
+
+/* true if nothing changed since the lease file was last written, each
+ * worker counts the records it adds in its own copy of the config */
+int journal_empty(void)
+{
+	unsigned int n;
+
+	if (server_config.journal_fd < 0 || server_config.journal_records) return 0;
+	for (n = 0; n < server_config.workers; n++)
+		if (server_config.shards[n].config.journal_records) return 0;
+	return 1;
 }
@@ -2,17 +2,24 @@
 #ifndef _FILES_H
 #define _FILES_H
 
+#include <stddef.h>
+
 struct config_keyword {
 	const char *keyword;
 	int (* const handler)(const char *line, void *var);
-	void *var;
+	size_t offset;			/* of the variable in struct server_config_t */
 	const char *def;
 };
 
 
 int read_config(const char *file);
 void write_leases(void);
+void reap_notify(int block);
 void read_leases(const char *file);
+void open_journal(void);
+void journal_lease(uint32_t lease);
+void sync_journal(void);
+int journal_empty(void);
 
 struct option_set *find_option(struct option_set *opt_list, char code);
 
@@ -0,0 +1,244 @@
+/*
+ * leasefile.c -- reading and writing versioned lease files
+ *
+ * Licensed under the GPL v2 or later, see the file LICENSE in this tarball.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+
+#include "libbb_udhcp.h"
+#include "leasefile.h"
+
+
+/* CRC-32 as used by ethernet and zlib */
+uint32_t leasefile_crc32(uint32_t crc, const void *buf, size_t len)
+{
+	static uint32_t table[256];
+	const uint8_t *p = buf;
+	uint32_t c;
+	int i, j;
+
+	if (!table[1])
+		for (i = 0; i < 256; i++) {
+			for (c = i, j = 0; j < 8; j++)
+				c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+
+	crc = ~crc;
+	while (len--)
+		crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+
+static uint32_t blocks(uint32_t count, uint32_t block)
+{
+	return (count + block - 1) / block;
+}
+
+
+/* Map a lease file and find its parts. Returns -1 if it can't be read,
+ * or with errno set to EBADMSG if it is truncated or its header is
+ * corrupt. An index that does not check out is ignored. */
+int leasefile_open(const char *file, struct leasefile *lf)
+{
+	struct leasefile_header *header;
+	struct stat st;
+	uint32_t count, nblocks, i;
+	size_t size;
+	int fd;
+
+	memset(lf, 0, sizeof(struct leasefile));
+	if ((fd = open(file, O_RDONLY)) < 0) return -1;
+	if (fstat(fd, &st) < 0) goto err;
+	lf->size = st.st_size;
+	if (lf->size) {
+		lf->map = mmap(NULL, lf->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (lf->map == MAP_FAILED) goto err;
+	}
+	close(fd);
+
+	header = lf->map;
+	if (lf->size < sizeof(struct leasefile_header) ||
+	    memcmp(header->magic, LEASEFILE_MAGIC, 4)) {
+		/* the old format is nothing but records */
+		lf->records = lf->map;
+		lf->count = lf->size / sizeof(struct dhcpOfferedAddr);
+		return 0;
+	}
+
+	count = ntohl(header->count);
+	if (ntohs(header->version) != LEASEFILE_VERSION || !ntohl(header->block) ||
+	    leasefile_crc32(0, header, offsetof(struct leasefile_header, crc)) != ntohl(header->crc))
+		goto bad;
+	nblocks = blocks(count, ntohl(header->block));
+	size = sizeof(struct leasefile_header) + count * sizeof(struct dhcpOfferedAddr) +
+		nblocks * sizeof(uint32_t);
+	if (ntohs(header->flags) & LEASEFILE_INDEX)
+		size += (2 * count + 1) * sizeof(uint32_t);
+	if (count > lf->size / sizeof(struct dhcpOfferedAddr) || size != lf->size)
+		goto bad;
+
+	lf->header = header;
+	lf->records = (struct dhcpOfferedAddr *) (header + 1);
+	lf->count = count;
+	lf->crcs = (uint32_t *) (lf->records + count);
+
+	if (ntohs(header->flags) & LEASEFILE_INDEX) {
+		lf->by_ip = lf->crcs + nblocks;
+		lf->by_mac = lf->by_ip + count;
+		if (leasefile_crc32(0, lf->by_ip, 2 * count * sizeof(uint32_t)) != ntohl(lf->by_mac[count]))
+			lf->by_ip = lf->by_mac = NULL;
+		for (i = 0; lf->by_ip && i < count; i++)
+			if (ntohl(lf->by_ip[i]) >= count || ntohl(lf->by_mac[i]) >= count)
+				lf->by_ip = lf->by_mac = NULL;
+	}
+	return 0;
+
+bad:
+	leasefile_close(lf);
+	errno = EBADMSG;
+	return -1;
+err:
+	close(fd);
+	return -1;
+}
+
+
+void leasefile_close(struct leasefile *lf)
+{
+	if (lf->size) munmap(lf->map, lf->size);
+	memset(lf, 0, sizeof(struct leasefile));
+}
+
+
+/* true if the records of a block are intact (the old format has no CRCs) */
+int leasefile_block_ok(struct leasefile *lf, uint32_t block)
+{
+	uint32_t per_block, first, n;
+
+	if (!lf->header) return 1;
+	per_block = ntohl(lf->header->block);
+	first = block * per_block;
+	n = lf->count - first < per_block ? lf->count - first : per_block;
+	return leasefile_crc32(0, lf->records + first, n * sizeof(struct dhcpOfferedAddr)) ==
+		ntohl(lf->crcs[block]);
+}
+
+
+/* Position in the ip index of the first record at ip (host order) or
+ * above, lf->count if there is none. Only for files with an index. */
+uint32_t leasefile_seek_ip(struct leasefile *lf, uint32_t ip)
+{
+	uint32_t lo = 0, hi = lf->count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (ntohl(lf->records[ntohl(lf->by_ip[mid])].yiaddr) < ip) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+
+/* Position in the mac index of the first record whose chaddr starts with
+ * the len bytes of mac, or would come after them. The records that start
+ * with them all follow from there. Only for files with an index. */
+uint32_t leasefile_seek_mac(struct leasefile *lf, uint8_t *mac, int len)
+{
+	uint32_t lo = 0, hi = lf->count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (memcmp(lf->records[ntohl(lf->by_mac[mid])].chaddr, mac, len) < 0) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+
+static struct dhcpOfferedAddr *sort_records;
+
+static int cmp_ip(const void *a, const void *b)
+{
+	uint32_t x = ntohl(sort_records[*(const uint32_t *) a].yiaddr);
+	uint32_t y = ntohl(sort_records[*(const uint32_t *) b].yiaddr);
+
+	return x < y ? -1 : x > y;
+}
+
+
+static int cmp_mac(const void *a, const void *b)
+{
+	return memcmp(sort_records[*(const uint32_t *) a].chaddr,
+		      sort_records[*(const uint32_t *) b].chaddr, 16);
+}
+
+
+/* write out the record numbers sorted with cmp, adding them to crc */
+static int write_index(FILE *fp, uint32_t *order, uint32_t count,
+		       int (*cmp)(const void *, const void *), uint32_t *crc)
+{
+	uint32_t i, n;
+
+	for (i = 0; i < count; i++) order[i] = i;
+	qsort(order, count, sizeof(uint32_t), cmp);
+	for (i = 0; i < count; i++) {
+		n = htonl(order[i]);
+		*crc = leasefile_crc32(*crc, &n, sizeof n);
+		if (fwrite(&n, sizeof n, 1, fp) != 1) return -1;
+	}
+	return 0;
+}
+
+
+/* Write records (already in lease file order, expires counting from
+ * time_base) as a versioned lease file, -1 on error */
+int leasefile_write(FILE *fp, struct dhcpOfferedAddr *records, uint32_t count,
+		    uint32_t start, uint32_t end, uint32_t time_base, int index)
+{
+	struct leasefile_header header;
+	uint32_t i, n, crc = 0, *order;
+	int ret = 0;
+
+	memcpy(header.magic, LEASEFILE_MAGIC, 4);
+	header.version = htons(LEASEFILE_VERSION);
+	header.flags = htons(index ? LEASEFILE_INDEX : 0);
+	header.start = start;
+	header.end = end;
+	header.time_base = htonl(time_base);
+	header.count = htonl(count);
+	header.block = htonl(LEASEFILE_BLOCK);
+	header.crc = htonl(leasefile_crc32(0, &header, offsetof(struct leasefile_header, crc)));
+
+	if (fwrite(&header, sizeof header, 1, fp) != 1 ||
+	    fwrite(records, sizeof(struct dhcpOfferedAddr), count, fp) != count)
+		return -1;
+
+	for (i = 0; i < count; i += LEASEFILE_BLOCK) {
+		n = count - i < LEASEFILE_BLOCK ? count - i : LEASEFILE_BLOCK;
+		n = htonl(leasefile_crc32(0, records + i, n * sizeof(struct dhcpOfferedAddr)));
+		if (fwrite(&n, sizeof n, 1, fp) != 1) return -1;
+	}
+
+	if (!index) return 0;
+
+	if (!(order = xmalloc((count + 1) * sizeof(uint32_t)))) return -1;
+	sort_records = records;
+	if (write_index(fp, order, count, cmp_ip, &crc) < 0 ||
+	    write_index(fp, order, count, cmp_mac, &crc) < 0)
+		ret = -1;
+	free(order);
+	crc = htonl(crc);
+	if (!ret && fwrite(&crc, sizeof crc, 1, fp) != 1) ret = -1;
+	return ret;
+}
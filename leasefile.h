@@ -0,0 +1,51 @@
+/* leasefile.h */
+#ifndef _LEASEFILE_H
+#define _LEASEFILE_H
+
+#include <stdio.h>
+#include "leases.h"
+
+/* Versioned lease file: a header, the lease records, a CRC-32 for every
+ * block of records and optionally the record numbers sorted by ip and by
+ * mac, followed by their own CRC-32. Everything is in network order, and
+ * record expires count the seconds left at time_base (0 once expired).
+ * Files without the magic are the old headerless stream of records. */
+#define LEASEFILE_MAGIC		"UDLF"
+#define LEASEFILE_VERSION	1
+#define LEASEFILE_BLOCK		256	/* records per CRC block */
+#define LEASEFILE_INDEX		0x0001	/* flags: sorted indexes follow the CRCs */
+
+struct leasefile_header {
+	uint8_t magic[4];
+	uint16_t version;
+	uint16_t flags;
+	uint32_t start;		/* pool the leases were handed out from */
+	uint32_t end;
+	uint32_t time_base;	/* when the file was written */
+	uint32_t count;		/* number of records */
+	uint32_t block;		/* records per CRC block */
+	uint32_t crc;		/* of the header up to here */
+};
+
+/* a lease file mapped into memory */
+struct leasefile {
+	void *map;
+	size_t size;
+	struct leasefile_header *header;	/* NULL for the headerless format */
+	struct dhcpOfferedAddr *records;
+	uint32_t count;
+	uint32_t *crcs;
+	uint32_t *by_ip;	/* NULL without a (valid) index */
+	uint32_t *by_mac;
+};
+
+uint32_t leasefile_crc32(uint32_t crc, const void *buf, size_t len);
+int leasefile_open(const char *file, struct leasefile *lf);
+void leasefile_close(struct leasefile *lf);
+int leasefile_block_ok(struct leasefile *lf, uint32_t block);
+uint32_t leasefile_seek_ip(struct leasefile *lf, uint32_t ip);
+uint32_t leasefile_seek_mac(struct leasefile *lf, uint8_t *mac, int len);
+int leasefile_write(FILE *fp, struct dhcpOfferedAddr *records, uint32_t count,
+		    uint32_t start, uint32_t end, uint32_t time_base, int index);
+
+#endif
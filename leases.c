@@ -5,6 +5,10 @@
 
 #include <time.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -21,35 +25,725 @@
 
 uint8_t blank_chaddr[] = {[0 ... 15] = 0};
 
+/* The table is kept as separate arrays so that expiry and address scans only
+ * pull in the field they need. Hardware addresses are stored in 6 bytes, the
+ * rare longer chaddr keeps its last 10 bytes in hwaddr_ext. */
+#define HWADDR_LEN	6
+#define HWADDR_EXT_LEN	(16 - HWADDR_LEN)
+
+/* With lease_store set, the per lease arrays live in a shared file mapping
+ * behind this header, so the table outlives the process and a restart only
+ * has to rebuild the indexes. The file is in host byte order and layout. */
+#define STORE_MAGIC	0x75644c53	/* "udLS" */
+#define STORE_VERSION	1
+#define STORE_ALIGN(x)	(((x) + 63) & ~(size_t) 63)
+struct lease_store {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t max_leases;
+	uint32_t count;		/* lease_count */
+};
+
+#define BITS_PER_WORD	(8 * sizeof(unsigned long))
+
+/* network and broadcast addresses of each /24 repeat every 256 addresses */
+#define EDGE_WORDS	(0x100 / BITS_PER_WORD)
+
+/* Every lease sits in one of two min-heaps ordered on expires: leases that
+ * were still running when last swept, and leases that have expired (empty
+ * leases have expires == 0, so they are the oldest expired of all). */
+#define LIVE_HEAP	0
+#define EXPIRED_HEAP	1
+struct lease_heap {
+	uint32_t *lease;	/* lease numbers in heap order */
+	uint32_t size;
+};
+
+/* The leases and indexes of one interface's pool */
+struct lease_table {
+	/* Leases are numbered from 1, 0 meaning no lease. The table (and everything
+	 * indexed by lease number) is filled in from the front as leases are handed
+	 * out, leases past lease_count are untouched. */
+	uint32_t lease_count;
+
+	uint32_t *expires_tab;			/* host order */
+	uint32_t *yiaddr_tab;			/* network order */
+	uint8_t (*hwaddr_tab)[HWADDR_LEN];
+	uint8_t (*hwaddr_ext)[HWADDR_EXT_LEN];
+	unsigned long *hwaddr_ext_map;		/* leases with a long chaddr */
+
+	struct lease_store *store;
+	size_t store_size;
+
+	/* Open addressing (linear probing) index of the lease table by chaddr.
+	 * Each slot holds a lease number, 0 marks an empty slot. Leases with
+	 * a blank chaddr (ARP conflicts, declines) are never in the index. */
+	uint32_t *chaddr_hash;
+	unsigned int chaddr_hash_mask;
+
+	/* Direct mapped index of the pool, slot ntohl(yiaddr) - ntohl(start) holds
+	 * the lease number of the lease on that address, 0 if there is none.
+	 * Leases outside of the pool (static leases) are not indexed. */
+	uint32_t *yiaddr_index;
+	uint32_t yiaddr_slots;
+
+	/* Allocation bitmaps over the same pool slots: addresses that have a lease,
+	 * addresses whose lease is known to have expired, and addresses that may
+	 * never be handed out dynamically. */
+	unsigned long *used_map;
+	unsigned long *expired_map;
+	unsigned long *reserved_map;
+	uint32_t map_words;
+	unsigned long edge_map[EDGE_WORDS];
+
+	/* With workers, the addresses of the pool that belong to the shard of
+	 * another worker. NULL when the table has the whole pool to itself. */
+	unsigned long *foreign_map;
+
+	struct lease_heap heaps[2];
+	uint32_t *heap_pos;	/* position of each lease in its heap */
+	uint8_t *heap_of;	/* which heap each lease is in */
+};
+
+/* the table of the interface (or worker shard) this thread is serving */
+static __thread struct lease_table *table;
+
+
+
+static void map_set(unsigned long *map, uint32_t bit)
+{
+	map[bit / BITS_PER_WORD] |= 1UL << (bit % BITS_PER_WORD);
+}
+
+
+static void map_clear(unsigned long *map, uint32_t bit)
+{
+	map[bit / BITS_PER_WORD] &= ~(1UL << (bit % BITS_PER_WORD));
+}
+
+
+static int map_test(unsigned long *map, uint32_t bit)
+{
+	return (map[bit / BITS_PER_WORD] >> (bit % BITS_PER_WORD)) & 1;
+}
+
+
+static int chaddr_blank(uint8_t *chaddr)
+{
+	return !memcmp(chaddr, blank_chaddr, 16);
+}
+
+
+/* does lease n belong to chaddr */
+static int lease_has_chaddr(uint32_t n, uint8_t *chaddr)
+{
+	if (memcmp(table->hwaddr_tab[n], chaddr, HWADDR_LEN)) return 0;
+	if (map_test(table->hwaddr_ext_map, n))
+		return !memcmp(table->hwaddr_ext[n], chaddr + HWADDR_LEN, HWADDR_EXT_LEN);
+	return !memcmp(blank_chaddr, chaddr + HWADDR_LEN, HWADDR_EXT_LEN);
+}
+
+
+static void store_chaddr(uint32_t n, uint8_t *chaddr)
+{
+	memcpy(table->hwaddr_tab[n], chaddr, HWADDR_LEN);
+	if (memcmp(blank_chaddr, chaddr + HWADDR_LEN, HWADDR_EXT_LEN)) {
+		memcpy(table->hwaddr_ext[n], chaddr + HWADDR_LEN, HWADDR_EXT_LEN);
+		map_set(table->hwaddr_ext_map, n);
+	} else map_clear(table->hwaddr_ext_map, n);
+}
+
+
+static unsigned int hash_chaddr(uint8_t *chaddr)
+{
+	uint32_t h = 2166136261UL; /* FNV-1a */
+	int i;
+
+	for (i = 0; i < 16; i++)
+		h = (h ^ chaddr[i]) * 16777619;
+	return h & table->chaddr_hash_mask;
+}
+
+
+/* return the index slot holding chaddr, or the empty slot where it would go */
+static unsigned int chaddr_slot(uint8_t *chaddr)
+{
+	unsigned int i;
+
+	for (i = hash_chaddr(chaddr); table->chaddr_hash[i]; i = (i + 1) & table->chaddr_hash_mask)
+		if (lease_has_chaddr(table->chaddr_hash[i], chaddr))
+			break;
+	return i;
+}
+
+
+static void chaddr_index_add(uint32_t n)
+{
+	uint8_t chaddr[16];
+
+	lease_chaddr(n, chaddr);
+	if (!chaddr_blank(chaddr))
+		table->chaddr_hash[chaddr_slot(chaddr)] = n;
+}
+
+
+/* take a lease out of the index, shifting back any entries that probed past it */
+static void chaddr_index_del(uint32_t n)
+{
+	unsigned int i, j, home;
+	uint8_t chaddr[16];
+
+	lease_chaddr(n, chaddr);
+	if (chaddr_blank(chaddr)) return;
+	i = chaddr_slot(chaddr);
+	if (table->chaddr_hash[i] != n) return;
+
+	for (j = (i + 1) & table->chaddr_hash_mask; table->chaddr_hash[j];
+	     j = (j + 1) & table->chaddr_hash_mask) {
+		lease_chaddr(table->chaddr_hash[j], chaddr);
+		home = hash_chaddr(chaddr);
+		/* can the entry at j legally live in the hole at i? */
+		if ((j > i && (home <= i || home > j)) ||
+		    (j < i && (home <= i && home > j))) {
+			table->chaddr_hash[i] = table->chaddr_hash[j];
+			i = j;
+		}
+	}
+	table->chaddr_hash[i] = 0;
+}
+
+
+/* offset of yiaddr into the pool, yiaddr_slots or more if it is outside of the pool */
+static uint32_t pool_offset(uint32_t yiaddr)
+{
+	return ntohl(yiaddr) - ntohl(server_config.start);
+}
+
+
+static void heap_place(struct lease_heap *heap, uint32_t pos, uint32_t n)
+{
+	heap->lease[pos] = n;
+	table->heap_pos[n] = pos;
+}
+
+
+static void heap_sift_up(struct lease_heap *heap, uint32_t pos)
+{
+	uint32_t n = heap->lease[pos], parent, *expires = table->expires_tab;
+
+	while (pos && expires[heap->lease[parent = (pos - 1) / 2]] > expires[n]) {
+		heap_place(heap, pos, heap->lease[parent]);
+		pos = parent;
+	}
+	heap_place(heap, pos, n);
+}
+
+
+static void heap_sift_down(struct lease_heap *heap, uint32_t pos)
+{
+	uint32_t n = heap->lease[pos], child, *expires = table->expires_tab;
+
+	while ((child = 2 * pos + 1) < heap->size) {
+		if (child + 1 < heap->size &&
+		    expires[heap->lease[child + 1]] < expires[heap->lease[child]])
+			child++;
+		if (expires[heap->lease[child]] >= expires[n]) break;
+		heap_place(heap, pos, heap->lease[child]);
+		pos = child;
+	}
+	heap_place(heap, pos, n);
+}
+
+
+/* move lease n into heap 'which', call after its expires has changed */
+static void heap_move(uint32_t n, int which)
+{
+	struct lease_heap *heap = &table->heaps[table->heap_of[n]];
+	uint32_t pos = table->heap_pos[n];
+
+	if (table->heap_of[n] != which) {
+		/* fill the hole with the last entry, then file n at the end of the other heap */
+		heap_place(heap, pos, heap->lease[--heap->size]);
+		if (pos < heap->size) {
+			heap_sift_up(heap, pos);
+			heap_sift_down(heap, table->heap_pos[heap->lease[pos]]);
+		}
+		heap = &table->heaps[which];
+		table->heap_of[n] = which;
+		pos = heap->size++;
+		heap_place(heap, pos, n);
+	}
+	heap_sift_up(heap, pos);
+	heap_sift_down(heap, table->heap_pos[n]);
+}
+
+
+/* move every lease that ran out by 'now' over to the expired heap */
+static void sweep_expired_leases(unsigned long now)
+{
+	struct lease_heap *live = &table->heaps[LIVE_HEAP];
+	uint32_t n, offset;
+
+	while (live->size && table->expires_tab[n = live->lease[0]] < now) {
+		heap_move(n, EXPIRED_HEAP);
+		if ((offset = pool_offset(table->yiaddr_tab[n])) < table->yiaddr_slots)
+			map_set(table->expired_map, offset);
+	}
+}
+
+
+static void lease_index_add(uint32_t n)
+{
+	uint32_t offset = pool_offset(table->yiaddr_tab[n]);
+
+	heap_move(n, LIVE_HEAP);
+	chaddr_index_add(n);
+	if (offset < table->yiaddr_slots) {
+		table->yiaddr_index[offset] = n;
+		map_set(table->used_map, offset);
+		map_clear(table->expired_map, offset);
+	}
+}
+
+
+/* take a lease out of the chaddr and yiaddr indexes and empty it */
+static void lease_unindex(uint32_t n)
+{
+	uint32_t offset = pool_offset(table->yiaddr_tab[n]);
+
+	chaddr_index_del(n);
+	if (offset < table->yiaddr_slots && table->yiaddr_index[offset] == n) {
+		table->yiaddr_index[offset] = 0;
+		map_clear(table->used_map, offset);
+		map_clear(table->expired_map, offset);
+	}
+	store_chaddr(n, blank_chaddr);
+	table->yiaddr_tab[n] = 0;
+	table->expires_tab[n] = 0;
+}
+
+
+/* take a lease out of all indexes and empty it */
+static void lease_index_del(uint32_t n)
+{
+	lease_unindex(n);
+	heap_move(n, EXPIRED_HEAP);
+}
+
+
+/* Reserve address space for a table indexed by lease number or pool offset.
+ * Pages are only backed by memory once they are touched, so a table sized for
+ * a huge pool costs no more than the part of it in use. */
+static void *reserve_table(size_t nmemb, size_t size)
+{
+	void *mem;
+
+	if (!nmemb) nmemb = 1;
+	mem = mmap(NULL, nmemb * size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (mem == MAP_FAILED)
+		mem = xcalloc(nmemb, size);
+	return mem;
+}
+
+
+/* reserve the network and broadcast addresses of each /24 (ie, 192.168.55.0
+ * and 192.168.55.255), static leases and the padding past the end of the pool */
+static void reserve_addresses(void)
+{
+	struct static_lease *cur;
+	uint32_t offset, start = ntohl(server_config.start);
+
+	for (offset = 0; offset < 0x100; offset++)
+		if (!((start + offset) & 0xFF) || ((start + offset) & 0xFF) == 0xFF)
+			map_set(table->edge_map, offset);
+
+	for (cur = server_config.static_leases.list; cur; cur = cur->next)
+		if ((offset = pool_offset(cur->ip)) < table->yiaddr_slots)
+			map_set(table->reserved_map, offset);
+
+	for (offset = table->yiaddr_slots; offset < table->map_words * BITS_PER_WORD; offset++)
+		map_set(table->reserved_map, offset);
+}
+
+
+/* double the chaddr index once it is half full */
+static void grow_chaddr_hash(void)
+{
+	uint32_t n;
+
+	free(table->chaddr_hash);
+	table->chaddr_hash_mask = table->chaddr_hash_mask ? 2 * table->chaddr_hash_mask + 1 : 15;
+	table->chaddr_hash = xcalloc(table->chaddr_hash_mask + 1, sizeof(uint32_t));
+	for (n = 1; n <= table->lease_count; n++)
+		chaddr_index_add(n);
+}
+
+
+/* Lay the per lease arrays out one after the other from base, behind a lease
+ * store header. Returns the space they take, base may be NULL to just size them. */
+static size_t place_tables(char *base, unsigned long slots)
+{
+	size_t off = STORE_ALIGN(sizeof(struct lease_store));
+
+#define PLACE(field, bytes) do { \
+		if (base) field = (void *) (base + off); \
+		off += STORE_ALIGN(bytes); \
+	} while (0)
+	PLACE(table->expires_tab, slots * sizeof(uint32_t));
+	PLACE(table->yiaddr_tab, slots * sizeof(uint32_t));
+	PLACE(table->hwaddr_tab, slots * HWADDR_LEN);
+	PLACE(table->hwaddr_ext, slots * HWADDR_EXT_LEN);
+	PLACE(table->hwaddr_ext_map, (slots / BITS_PER_WORD + 1) * sizeof(unsigned long));
+#undef PLACE
+	return off;
+}
+
+
+/* map the lease store, starting it over if it was not written for this max_leases */
+static struct lease_store *open_store(size_t size)
+{
+	struct lease_store header, *mapped;
+	struct stat st;
+	int fd;
+
+	if ((fd = open(server_config.lease_store, O_RDWR | O_CREAT, 0644)) < 0) {
+		LOG(LOG_ERR, "Unable to open %s: %m", server_config.lease_store);
+		return NULL;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		LOG(LOG_ERR, "Unable to stat %s: %m", server_config.lease_store);
+		close(fd);
+		return NULL;
+	}
+
+	if ((size_t) st.st_size != size ||
+	    read(fd, &header, sizeof header) != sizeof header ||
+	    header.magic != STORE_MAGIC || header.version != STORE_VERSION ||
+	    header.max_leases != server_config.max_leases ||
+	    header.count > server_config.max_leases) {
+		if (st.st_size)
+			LOG(LOG_WARNING, "%s does not match this configuration, starting it over",
+				server_config.lease_store);
+		if (ftruncate(fd, 0) < 0) goto err;
+	}
+	if (ftruncate(fd, size) < 0) goto err;
+
+	mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (mapped == MAP_FAILED) goto err;
+	close(fd);
+
+	mapped->magic = STORE_MAGIC;
+	mapped->version = STORE_VERSION;
+	mapped->max_leases = server_config.max_leases;
+	return mapped;
+
+err:
+	LOG(LOG_ERR, "Unable to map %s: %m", server_config.lease_store);
+	close(fd);
+	return NULL;
+}
+
+
+/* Put a lease straight into the next slot of the table without indexing it,
+ * for loading a whole table at once before index_leases(). 0 if it is full. */
+uint32_t place_lease(uint8_t *chaddr, uint32_t yiaddr, unsigned long expires)
+{
+	uint32_t n;
+
+	if (table->lease_count >= server_config.max_leases) return 0;
+
+	n = ++table->lease_count;
+	if (table->store) table->store->count = table->lease_count;
+	store_chaddr(n, chaddr);
+	table->yiaddr_tab[n] = yiaddr;
+	table->expires_tab[n] = expires;
+	return n;
+}
+
+
+/* Build the indexes and heaps of a table filled in by place_lease() or
+ * restored from the lease store, in one pass over the leases. Like
+ * add_lease(), a later lease replaces any earlier one with the same
+ * chaddr or yiaddr. Leases outside of the pool are dropped, as a store
+ * may have been written for another start and end. */
+void index_leases(void)
+{
+	unsigned long now = time(0);
+	uint32_t n, m, offset, pos, count = table->lease_count;
+	uint8_t chaddr[16];
+	int which;
+
+	/* size the chaddr index before there is anything to rehash */
+	table->lease_count = 0;
+	while (2 * count > table->chaddr_hash_mask) grow_chaddr_hash();
+	table->lease_count = count;
+
+	for (n = 1; n <= table->lease_count; n++) {
+		/* the pool has changed since, or another shard has claimed the address */
+		offset = pool_offset(table->yiaddr_tab[n]);
+		if (offset >= table->yiaddr_slots ||
+		    (table->foreign_map && map_test(table->foreign_map, offset))) {
+			lease_unindex(n);
+			continue;
+		}
+
+		lease_chaddr(n, chaddr);
+		if ((m = find_lease_by_chaddr(chaddr)))
+			lease_unindex(m);
+		if (offset < table->yiaddr_slots && (m = table->yiaddr_index[offset]))
+			lease_unindex(m);
+
+		chaddr_index_add(n);
+		if (offset < table->yiaddr_slots) {
+			table->yiaddr_index[offset] = n;
+			map_set(table->used_map, offset);
+		}
+	}
+
+	for (n = 1; n <= table->lease_count; n++) {
+		which = table->expires_tab[n] < now ? EXPIRED_HEAP : LIVE_HEAP;
+		table->heap_of[n] = which;
+		heap_place(&table->heaps[which], table->heaps[which].size++, n);
+		if (which == EXPIRED_HEAP &&
+		    (offset = pool_offset(table->yiaddr_tab[n])) < table->yiaddr_slots &&
+		    table->yiaddr_index[offset] == n)
+			map_set(table->expired_map, offset);
+	}
+
+	for (which = LIVE_HEAP; which <= EXPIRED_HEAP; which++)
+		for (pos = table->heaps[which].size / 2; pos-- > 0;)
+			heap_sift_down(&table->heaps[which], pos);
+}
+
+
+/* Allocate the lease table and its indexes for server_config and make it
+ * the current one. Only bookkeeping for the pool and the leases actually
+ * used is touched. Returns 1 if the leases were restored from the lease store. */
+int init_lease_table(void)
+{
+	unsigned long slots = server_config.max_leases + 1;
+	size_t size = place_tables(NULL, slots);
+
+	server_config.leases = table = xcalloc(1, sizeof(struct lease_table));
+	table->store = NULL;
+	if (server_config.lease_store && server_config.lease_store[0])
+		table->store = open_store(size);
+	if (table->store) table->store_size = size;
+	place_tables(table->store ? (char *) table->store : reserve_table(size, 1), slots);
+	table->lease_count = 0;
+	grow_chaddr_hash();
+
+	if (ntohl(server_config.end) >= ntohl(server_config.start))
+		table->yiaddr_slots = ntohl(server_config.end) - ntohl(server_config.start) + 1;
+	table->yiaddr_index = reserve_table(table->yiaddr_slots, sizeof(uint32_t));
+
+	table->map_words = (table->yiaddr_slots + BITS_PER_WORD - 1) / BITS_PER_WORD;
+	table->used_map = reserve_table(table->map_words, sizeof(unsigned long));
+	table->expired_map = reserve_table(table->map_words, sizeof(unsigned long));
+	table->reserved_map = reserve_table(table->map_words, sizeof(unsigned long));
+	reserve_addresses();
+
+	table->heaps[LIVE_HEAP].lease = reserve_table(slots, sizeof(uint32_t));
+	table->heaps[EXPIRED_HEAP].lease = reserve_table(slots, sizeof(uint32_t));
+	table->heap_pos = reserve_table(slots, sizeof(uint32_t));
+	table->heap_of = reserve_table(slots, sizeof(uint8_t));
+
+	if (!table->store || !table->store->count) return 0;
+	table->lease_count = table->store->count;
+	index_leases();
+	DEBUG(LOG_INFO, "Restored %lu leases from %s", (unsigned long) table->lease_count,
+		server_config.lease_store);
+	return 1;
+}
+
+
+/* switch to the lease table of another interface */
+void select_lease_table(struct lease_table *leases)
+{
+	table = leases;
+}
+
+
+/* Hand the table shard 'shard' of 'shards' of the pool, a run of whole
+ * words of the allocation bitmaps. Addresses outside of it belong to
+ * other shards until they are taken over. */
+void shard_lease_table(unsigned int shard, unsigned int shards)
+{
+	uint32_t i, first = (uint64_t) table->map_words * shard / shards;
+	uint32_t last = (uint64_t) table->map_words * (shard + 1) / shards;
+
+	table->foreign_map = reserve_table(table->map_words, sizeof(unsigned long));
+	for (i = 0; i < table->map_words; i++)
+		if (i < first || i >= last) table->foreign_map[i] = ~0UL;
+}
+
+
+/* true if yiaddr is in the pool and in the shard of this table */
+int owns_address(uint32_t yiaddr)
+{
+	uint32_t offset = pool_offset(yiaddr);
+
+	return offset < table->yiaddr_slots &&
+		!(table->foreign_map && map_test(table->foreign_map, offset));
+}
+
+
+/* move an address of the pool into the shard of this table */
+void take_address(uint32_t yiaddr)
+{
+	uint32_t offset = pool_offset(yiaddr);
+
+	if (table->foreign_map && offset < table->yiaddr_slots)
+		map_clear(table->foreign_map, offset);
+}
+
+
+/* and out of it, any lease on it should be cleared first */
+void give_address(uint32_t yiaddr)
+{
+	uint32_t offset = pool_offset(yiaddr);
+
+	if (table->foreign_map && offset < table->yiaddr_slots) map_set(table->foreign_map, offset);
+}
+
+
+/* number of leases in use in the table, lease numbers run from 1 to this */
+uint32_t lease_table_size(void)
+{
+	return table->lease_count;
+}
+
+
+/* flush the whole lease store out to disk */
+void sync_lease_store(void)
+{
+	if (table->store && msync(table->store, table->store_size, MS_SYNC) < 0)
+		LOG(LOG_ERR, "Unable to sync %s: %m", server_config.lease_store);
+}
+
+
+static void sync_range(void *start, size_t len)
+{
+	static uintptr_t page_mask;
+	uintptr_t page;
+
+	if (!page_mask) page_mask = ~((uintptr_t) sysconf(_SC_PAGESIZE) - 1);
+	page = (uintptr_t) start & page_mask;
+	msync((void *) page, (uintptr_t) start + len - page, MS_SYNC);
+}
+
+
+/* with sync_store, flush the pages holding lease n to disk as soon as it changes */
+static void sync_lease(uint32_t n)
+{
+	if (!table->store || !server_config.sync_store) return;
+
+	sync_range(table->store, sizeof(struct lease_store));
+	sync_range(&table->expires_tab[n], sizeof(uint32_t));
+	sync_range(&table->yiaddr_tab[n], sizeof(uint32_t));
+	sync_range(table->hwaddr_tab[n], HWADDR_LEN);
+	sync_range(table->hwaddr_ext[n], HWADDR_EXT_LEN);
+	sync_range(&table->hwaddr_ext_map[n / BITS_PER_WORD], sizeof(unsigned long));
+}
+
+
+/* take the next unused lease of the table, 0 if it is full */
+static uint32_t grow_lease_table(void)
+{
+	struct lease_heap *heap = &table->heaps[EXPIRED_HEAP];
+	uint32_t n;
+
+	if (table->lease_count >= server_config.max_leases) return 0;
+
+	/* an empty lease is expired */
+	n = ++table->lease_count;
+	if (table->store) table->store->count = table->lease_count;
+	table->heap_of[n] = EXPIRED_HEAP;
+	heap_place(heap, heap->size++, n);
+	heap_sift_up(heap, table->heap_pos[n]);
+
+	if (2 * table->lease_count > table->chaddr_hash_mask) grow_chaddr_hash();
+	return n;
+}
+
+
 /* clear every lease out that chaddr OR yiaddr matches and is nonzero */
 void clear_lease(uint8_t *chaddr, uint32_t yiaddr)
 {
-	unsigned int i, j;
+	uint32_t lease;
 
-	for (j = 0; j < 16 && !chaddr[j]; j++);
+	if ((lease = find_lease_by_chaddr(chaddr))) {
+		lease_index_del(lease);
+		sync_lease(lease);
+	}
 
-	for (i = 0; i < server_config.max_leases; i++)
-		if ((j != 16 && !memcmp(leases[i].chaddr, chaddr, 16)) ||
-		    (yiaddr && leases[i].yiaddr == yiaddr)) {
-			memset(&(leases[i]), 0, sizeof(struct dhcpOfferedAddr));
-		}
+	if (yiaddr && (lease = find_lease_by_yiaddr(yiaddr))) {
+		lease_index_del(lease);
+		sync_lease(lease);
+	}
+}
+
+
+/* change when a lease runs out */
+void set_lease_expires(uint32_t lease, unsigned long expires)
+{
+	uint32_t offset = pool_offset(table->yiaddr_tab[lease]);
+
+	table->expires_tab[lease] = expires;
+	heap_move(lease, LIVE_HEAP);
+	if (offset < table->yiaddr_slots)
+		map_clear(table->expired_map, offset);
+	sync_lease(lease);
+}
+
+
+/* forget which client holds a lease, leaving the address reserved until it expires */
+void clear_lease_chaddr(uint32_t lease)
+{
+	chaddr_index_del(lease);
+	store_chaddr(lease, blank_chaddr);
+	sync_lease(lease);
+}
+
+
+/* the oldest lease that ran out by now, empty leases first */
+static uint32_t oldest_expired(unsigned long now)
+{
+	struct lease_heap *expired = &table->heaps[EXPIRED_HEAP];
+	uint32_t lease;
+
+	sweep_expired_leases(now);
+
+	/* hang on to expired leases for as long as there is room for new ones */
+	if (expired->size && !table->expires_tab[expired->lease[0]])
+		return expired->lease[0];
+	if ((lease = grow_lease_table()))
+		return lease;
+	return expired->size ? expired->lease[0] : 0;
 }
 
 
 /* add a lease into the table, clearing out any old ones */
-struct dhcpOfferedAddr *add_lease(uint8_t *chaddr, uint32_t yiaddr, unsigned long lease)
+uint32_t add_lease(uint8_t *chaddr, uint32_t yiaddr, unsigned long lease)
 {
-	struct dhcpOfferedAddr *oldest;
+	uint32_t oldest;
+	unsigned long now = time(0);
 
 	/* clean out any old ones */
 	clear_lease(chaddr, yiaddr);
 
-	oldest = oldest_expired_lease();
+	oldest = oldest_expired(now);
 
 	if (oldest) {
-		memcpy(oldest->chaddr, chaddr, 16);
-		oldest->yiaddr = yiaddr;
-		oldest->expires = time(0) + lease;
+		lease_index_del(oldest);
+		store_chaddr(oldest, chaddr);
+		table->yiaddr_tab[oldest] = yiaddr;
+		table->expires_tab[oldest] = now + lease;
+		lease_index_add(oldest);
+		sync_lease(oldest);
+		journal_lease(oldest);
 	}
 
 	return oldest;
@@ -57,56 +751,76 @@ struct dhcpOfferedAddr *add_lease(uint8_t *chaddr, uint32_t yiaddr, unsigned lon
 
 
 /* true if a lease has expired */
-int lease_expired(struct dhcpOfferedAddr *lease)
+int lease_expired(uint32_t lease)
 {
-	return (lease->expires < (unsigned long) time(0));
+	return (table->expires_tab[lease] < (unsigned long) time(0));
 }
 
 
-/* Find the oldest expired lease, NULL if there are no expired leases */
-struct dhcpOfferedAddr *oldest_expired_lease(void)
+uint32_t lease_yiaddr(uint32_t lease)
 {
-	struct dhcpOfferedAddr *oldest = NULL;
-	unsigned long oldest_lease = time(0);
-	unsigned int i;
+	return table->yiaddr_tab[lease];
+}
 
 
-	for (i = 0; i < server_config.max_leases; i++)
-		if (oldest_lease > leases[i].expires) {
-			oldest_lease = leases[i].expires;
-			oldest = &(leases[i]);
-		}
-	return oldest;
+unsigned long lease_expires(uint32_t lease)
+{
+	return table->expires_tab[lease];
+}
 
+
+/* copy the full 16 byte chaddr of a lease out to chaddr */
+void lease_chaddr(uint32_t lease, uint8_t *chaddr)
+{
+	memcpy(chaddr, table->hwaddr_tab[lease], HWADDR_LEN);
+	if (map_test(table->hwaddr_ext_map, lease))
+		memcpy(chaddr + HWADDR_LEN, table->hwaddr_ext[lease], HWADDR_EXT_LEN);
+	else memset(chaddr + HWADDR_LEN, 0, HWADDR_EXT_LEN);
 }
 
 
-/* Find the first lease that matches chaddr, NULL if no match */
-struct dhcpOfferedAddr *find_lease_by_chaddr(uint8_t *chaddr)
+/* fill in the lease file record of a lease, expires left in host order */
+void get_lease_record(uint32_t lease, struct dhcpOfferedAddr *record)
 {
-	unsigned int i;
+	lease_chaddr(lease, record->chaddr);
+	record->yiaddr = table->yiaddr_tab[lease];
+	record->expires = table->expires_tab[lease];
+}
 
-	for (i = 0; i < server_config.max_leases; i++)
-		if (!memcmp(leases[i].chaddr, chaddr, 16)) return &(leases[i]);
 
-	return NULL;
+/* Find the oldest expired lease, 0 if there are no expired leases */
+uint32_t oldest_expired_lease(void)
+{
+	return oldest_expired(time(0));
 }
 
 
-/* Find the first lease that matches yiaddr, NULL is no match */
-struct dhcpOfferedAddr *find_lease_by_yiaddr(uint32_t yiaddr)
+/* Find the lease that matches chaddr, 0 if no match */
+uint32_t find_lease_by_chaddr(uint8_t *chaddr)
 {
-	unsigned int i;
+	if (chaddr_blank(chaddr)) return 0;
+	return table->chaddr_hash[chaddr_slot(chaddr)];
+}
 
-	for (i = 0; i < server_config.max_leases; i++)
-		if (leases[i].yiaddr == yiaddr) return &(leases[i]);
 
-	return NULL;
+/* Find the first lease that matches yiaddr, 0 is no match */
+uint32_t find_lease_by_yiaddr(uint32_t yiaddr)
+{
+	uint32_t n, offset = pool_offset(yiaddr);
+
+	if (offset < table->yiaddr_slots)
+		return table->yiaddr_index[offset];
+
+	/* static leases may live outside of the pool */
+	for (n = 1; n <= table->lease_count; n++)
+		if (table->yiaddr_tab[n] == yiaddr) return n;
+
+	return 0;
 }
 
 
 /* check is an IP is taken, if it is, add it to the lease table */
-static int check_ip(uint32_t addr)
+int check_ip(uint32_t addr)
 {
 	struct in_addr temp;
 
@@ -120,39 +834,44 @@ static int check_ip(uint32_t addr)
 }
 
 
-/* find an assignable address, it check_expired is true, we check all the expired leases as well.
- * Maybe this should try expired leases by age... */
-uint32_t find_address(int check_expired)
+/* Find an assignable address, it check_expired is true, we check all the
+ * expired leases as well. Free addresses are found a word of the pool at
+ * a time, lowest address first. Unless probe is 0, an address that
+ * answers an arp is reserved and skipped. */
+static uint32_t pool_address(int check_expired, int probe)
 {
-	uint32_t addr, ret;
-	struct dhcpOfferedAddr *lease = NULL;
-
-	addr = ntohl(server_config.start); /* addr is in host order here */
-	for (;addr <= ntohl(server_config.end); addr++) {
-
-		/* ie, 192.168.55.0 */
-		if (!(addr & 0xFF)) continue;
-
-		/* ie, 192.168.55.255 */
-		if ((addr & 0xFF) == 0xFF) continue;
+	unsigned long word;
+	uint32_t i, offset, ret;
 
-		/* Only do if it isn't an assigned as a static lease */
-		if(!reservedIp(server_config.static_leases, htonl(addr)))
-		{
+	if (check_expired) sweep_expired_leases(time(0));
 
-		/* lease is not taken */
-		ret = htonl(addr);
-		if ((!(lease = find_lease_by_yiaddr(ret)) ||
+	for (i = 0; i < table->map_words; i++) {
+		word = ~table->used_map[i];
+		if (check_expired) word |= table->expired_map[i];
+		word &= ~(table->reserved_map[i] | table->edge_map[i % EDGE_WORDS]);
+		if (table->foreign_map) word &= ~table->foreign_map[i];
 
-		     /* or it expired and we are checking for expired leases */
-		     (check_expired  && lease_expired(lease))) &&
+		for (; word; word &= word - 1) {
+			offset = i * BITS_PER_WORD + __builtin_ctzl(word);
+			ret = htonl(ntohl(server_config.start) + offset);
 
-		     /* and it isn't on the network */
-		     !check_ip(ret)) {
-			return ret;
-			break;
+			/* and it isn't on the network */
+			if (!probe || !check_ip(ret))
+				return ret;
 		}
 	}
-	}
 	return 0;
 }
+
+
+uint32_t find_address(int check_expired)
+{
+	return pool_address(check_expired, 1);
+}
+
+
+/* the address find_address() would try first, without probing it */
+uint32_t free_address(int check_expired)
+{
+	return pool_address(check_expired, 0);
+}
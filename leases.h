@@ -3,21 +3,43 @@
 #define _LEASES_H
 
 
+/* a lease as stored in the lease file, the table itself hands out
+ * lease numbers (1 based, 0 for none) and keeps the fields apart */
 struct dhcpOfferedAddr {
 	uint8_t chaddr[16];
 	uint32_t yiaddr;	/* network order */
-	uint32_t expires;	/* host order */
+	uint32_t expires;	/* network order on disk */
 };
 
+struct lease_table;
+
 extern uint8_t blank_chaddr[];
 
+int init_lease_table(void);
+void select_lease_table(struct lease_table *leases);
+uint32_t lease_table_size(void);
+void shard_lease_table(unsigned int shard, unsigned int shards);
+int owns_address(uint32_t yiaddr);
+void take_address(uint32_t yiaddr);
+void give_address(uint32_t yiaddr);
+void sync_lease_store(void);
 void clear_lease(uint8_t *chaddr, uint32_t yiaddr);
-struct dhcpOfferedAddr *add_lease(uint8_t *chaddr, uint32_t yiaddr, unsigned long lease);
-int lease_expired(struct dhcpOfferedAddr *lease);
-struct dhcpOfferedAddr *oldest_expired_lease(void);
-struct dhcpOfferedAddr *find_lease_by_chaddr(uint8_t *chaddr);
-struct dhcpOfferedAddr *find_lease_by_yiaddr(uint32_t yiaddr);
+void set_lease_expires(uint32_t lease, unsigned long expires);
+void clear_lease_chaddr(uint32_t lease);
+uint32_t add_lease(uint8_t *chaddr, uint32_t yiaddr, unsigned long lease);
+uint32_t place_lease(uint8_t *chaddr, uint32_t yiaddr, unsigned long expires);
+void index_leases(void);
+int lease_expired(uint32_t lease);
+uint32_t lease_yiaddr(uint32_t lease);
+unsigned long lease_expires(uint32_t lease);
+void lease_chaddr(uint32_t lease, uint8_t *chaddr);
+void get_lease_record(uint32_t lease, struct dhcpOfferedAddr *record);
+uint32_t oldest_expired_lease(void);
+uint32_t find_lease_by_chaddr(uint8_t *chaddr);
+uint32_t find_lease_by_yiaddr(uint32_t yiaddr);
 uint32_t find_address(int check_expired);
+uint32_t free_address(int check_expired);
+int check_ip(uint32_t addr);
 
 
 #endif
@@ -23,6 +23,10 @@
 #define UDHCP_DEBUG
 #endif
 
+#ifdef CONFIG_FEATURE_UDHCPD_IO_URING
+#define UDHCP_IO_URING
+#endif
+
 #define COMBINED_BINARY
 #include "version.h"
 
@@ -37,18 +41,27 @@
 /* from packet.h */
 #define init_header		udhcp_init_header
 #define get_packet		udhcp_get_packet
+#define get_packets		udhcp_get_packets
+#define get_ring_packets	udhcp_get_ring_packets
 #define checksum		udhcp_checksum
 #define raw_packet		udhcp_raw_packet
 #define kernel_packet		udhcp_kernel_packet
+#define make_udp_packet		udhcp_make_udp_packet
+#define raw_packets		udhcp_raw_packets
+#define kernel_packets		udhcp_kernel_packets
 /* from pidfile.h */
 #define pidfile_acquire		udhcp_pidfile_acquire
 #define pidfile_write_release	udhcp_pidfile_write_release
 /* from options.h */
 #define get_option		udhcp_get_option
-#define end_option		udhcp_end_option
-#define add_option_string	udhcp_add_option_string
-#define add_simple_option	udhcp_add_simple_option
+#define index_options		udhcp_index_options
+#define start_options		udhcp_start_options
+#define put_option		udhcp_put_option
+#define put_option_string	udhcp_put_option_string
+#define put_simple_option	udhcp_put_simple_option
 #define option_lengths		udhcp_option_lengths
+#define dhcp_option_codes	udhcp_dhcp_option_codes
+#define option_by_name		udhcp_option_by_name
 /* from socket.h */
 #define listen_socket		udhcp_listen_socket
 #define read_interface		udhcp_read_interface
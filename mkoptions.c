@@ -0,0 +1,62 @@
+/* mkoptions.c
+ *
+ * Generates option_names.h at build time: a perfect hash of the names in
+ * option_list.h, so that an option is looked up by name with one probe.
+ * It runs on the build host.
+ *
+ * Licensed under the GPL v2 or later, see the file LICENSE in this tarball.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "option_hash.h"
+
+#define MAX_SLOTS	1024
+#define MAX_SEED	100000
+
+static const struct {
+	const char *name;
+	int code;
+} options[] = {
+#define OPTION(name, flags, code) {name, code},
+#include "option_list.h"
+#undef OPTION
+};
+
+#define NOPTIONS	(sizeof(options) / sizeof(options[0]))
+
+
+int main(void)
+{
+	static unsigned char slots[MAX_SLOTS];
+	unsigned int size, i;
+	uint32_t seed, slot;
+
+	/* the smallest power of 2, at least twice the options, that some seed
+	 * spreads them over without a collision */
+	for (size = 2; size < 2 * NOPTIONS; size <<= 1);
+	for (; size <= MAX_SLOTS; size <<= 1)
+		for (seed = 0; seed < MAX_SEED; seed++) {
+			memset(slots, 0, size);
+			for (i = 0; i < NOPTIONS; i++) {
+				slot = option_name_hash(options[i].name, seed) & (size - 1);
+				if (slots[slot]) break;
+				slots[slot] = options[i].code;
+			}
+			if (i == NOPTIONS) goto found;
+		}
+	fprintf(stderr, "mkoptions: no perfect hash for the option names\n");
+	return 1;
+
+found:
+	printf("/* option_names.h, generated by mkoptions from option_list.h */\n\n");
+	printf("#define OPTION_NAME_SEED\t%luU\n", (unsigned long) seed);
+	printf("#define OPTION_NAME_SLOTS\t%u\n\n", size);
+	printf("/* the code of the option whose name hashes to each slot, 0 for none */\n");
+	printf("static const uint8_t option_name_slots[OPTION_NAME_SLOTS] = {");
+	for (i = 0; i < size; i++)
+		printf("%s0x%02x,", i % 8 ? " " : "\n\t", slots[i]);
+	printf("\n};\n");
+	return 0;
+}
@@ -0,0 +1,22 @@
+/* option_hash.h */
+#ifndef _OPTION_HASH_H
+#define _OPTION_HASH_H
+
+#include <stdint.h>
+#include <ctype.h>
+
+/* FNV-1a of an option name started from seed, folded to lower case like
+ * the strcasecmp() names are matched with. mkoptions picks the seed that
+ * makes it a perfect hash of the names in option_list.h. */
+static uint32_t option_name_hash(const char *name, uint32_t seed)
+{
+	uint32_t hash = 2166136261U ^ seed;
+
+	while (*name) {
+		hash ^= (unsigned char) tolower((unsigned char) *name++);
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+#endif
@@ -0,0 +1,36 @@
+/* option_list.h
+ *
+ * Every option udhcp knows, in code order. options.c expands the list
+ * into dhcp_options[] and the table indexed by code, and mkoptions into
+ * the hash of their names. Supported options are easily added here.
+ */
+
+/*	name		flags					code */
+OPTION("subnet",	OPTION_IP | OPTION_REQ,			0x01)
+OPTION("timezone",	OPTION_S32,				0x02)
+OPTION("router",	OPTION_IP | OPTION_LIST | OPTION_REQ,	0x03)
+OPTION("timesvr",	OPTION_IP | OPTION_LIST,		0x04)
+OPTION("namesvr",	OPTION_IP | OPTION_LIST,		0x05)
+OPTION("dns",		OPTION_IP | OPTION_LIST | OPTION_REQ,	0x06)
+OPTION("logsvr",	OPTION_IP | OPTION_LIST,		0x07)
+OPTION("cookiesvr",	OPTION_IP | OPTION_LIST,		0x08)
+OPTION("lprsvr",	OPTION_IP | OPTION_LIST,		0x09)
+OPTION("hostname",	OPTION_STRING | OPTION_REQ,		0x0c)
+OPTION("bootsize",	OPTION_U16,				0x0d)
+OPTION("domain",	OPTION_STRING | OPTION_REQ,		0x0f)
+OPTION("swapsvr",	OPTION_IP,				0x10)
+OPTION("rootpath",	OPTION_STRING,				0x11)
+OPTION("ipttl",		OPTION_U8,				0x17)
+OPTION("mtu",		OPTION_U16,				0x1a)
+OPTION("broadcast",	OPTION_IP | OPTION_REQ,			0x1c)
+OPTION("nisdomain",	OPTION_STRING | OPTION_REQ,		0x28)
+OPTION("nissrv",	OPTION_IP | OPTION_LIST | OPTION_REQ,	0x29)
+OPTION("ntpsrv",	OPTION_IP | OPTION_LIST | OPTION_REQ,	0x2a)
+OPTION("wins",		OPTION_IP | OPTION_LIST,		0x2c)
+OPTION("requestip",	OPTION_IP,				0x32)
+OPTION("lease",		OPTION_U32,				0x33)
+OPTION("dhcptype",	OPTION_U8,				0x35)
+OPTION("serverid",	OPTION_IP,				0x36)
+OPTION("message",	OPTION_STRING,				0x38)
+OPTION("tftp",		OPTION_STRING,				0x42)
+OPTION("bootfile",	OPTION_STRING,				0x43)
@@ -10,42 +10,25 @@
 #include "dhcpd.h"
 #include "options.h"
 #include "files.h"
+#include "option_hash.h"
+#include "option_names.h"
 
 
-/* supported options are easily added here */
+/* the options in code order, ending with a blank one */
 struct dhcp_option dhcp_options[] = {
-	/* name[10]	flags					code */
-	{"subnet",	OPTION_IP | OPTION_REQ,			0x01},
-	{"timezone",	OPTION_S32,				0x02},
-	{"router",	OPTION_IP | OPTION_LIST | OPTION_REQ,	0x03},
-	{"timesvr",	OPTION_IP | OPTION_LIST,		0x04},
-	{"namesvr",	OPTION_IP | OPTION_LIST,		0x05},
-	{"dns",		OPTION_IP | OPTION_LIST | OPTION_REQ,	0x06},
-	{"logsvr",	OPTION_IP | OPTION_LIST,		0x07},
-	{"cookiesvr",	OPTION_IP | OPTION_LIST,		0x08},
-	{"lprsvr",	OPTION_IP | OPTION_LIST,		0x09},
-	{"hostname",	OPTION_STRING | OPTION_REQ,		0x0c},
-	{"bootsize",	OPTION_U16,				0x0d},
-	{"domain",	OPTION_STRING | OPTION_REQ,		0x0f},
-	{"swapsvr",	OPTION_IP,				0x10},
-	{"rootpath",	OPTION_STRING,				0x11},
-	{"ipttl",	OPTION_U8,				0x17},
-	{"mtu",		OPTION_U16,				0x1a},
-	{"broadcast",	OPTION_IP | OPTION_REQ,			0x1c},
-	{"nisdomain",	OPTION_STRING | OPTION_REQ,		0x28},
-	{"nissrv",	OPTION_IP | OPTION_LIST | OPTION_REQ,	0x29},
-	{"ntpsrv",	OPTION_IP | OPTION_LIST | OPTION_REQ,	0x2a},
-	{"wins",	OPTION_IP | OPTION_LIST,		0x2c},
-	{"requestip",	OPTION_IP,				0x32},
-	{"lease",	OPTION_U32,				0x33},
-	{"dhcptype",	OPTION_U8,				0x35},
-	{"serverid",	OPTION_IP,				0x36},
-	{"message",	OPTION_STRING,				0x38},
-	{"tftp",	OPTION_STRING,				0x42},
-	{"bootfile",	OPTION_STRING,				0x43},
+#define OPTION(name, flags, code) {name, flags, code},
+#include "option_list.h"
+#undef OPTION
 	{"",		0x00,				0x00}
 };
 
+/* the same options indexed by their code, blank where there is none */
+struct dhcp_option dhcp_option_codes[256] = {
+#define OPTION(name, flags, code) [code] = {name, flags, code},
+#include "option_list.h"
+#undef OPTION
+};
+
 /* Lengths of the different option types */
 int option_lengths[] = {
 	[OPTION_IP] =		4,
@@ -60,113 +43,136 @@ int option_lengths[] = {
 };
 
 
-/* get an option with bounds checking (warning, not aligned). */
-uint8_t *get_option(struct dhcpMessage *packet, int code)
+/* The option called name, in any case, NULL if there is none. The names
+ * hash perfectly (see mkoptions), so only one of them is compared. */
+struct dhcp_option *option_by_name(const char *name)
 {
-	int i, length;
-	uint8_t *optionptr;
-	int over = 0, done = 0, curr = OPTION_FIELD;
-
-	optionptr = packet->options;
-	i = 0;
-	length = 308;
-	while (!done) {
-		if (i >= length) {
-			LOG(LOG_WARNING, "bogus packet, option fields too long.");
-			return NULL;
-		}
-		if (optionptr[i + OPT_CODE] == code) {
-			if (i + 1 + optionptr[i + OPT_LEN] >= length) {
-				LOG(LOG_WARNING, "bogus packet, option fields too long.");
-				return NULL;
-			}
-			return optionptr + i + 2;
-		}
-		switch (optionptr[i + OPT_CODE]) {
-		case DHCP_PADDING:
+	struct dhcp_option *option;
+
+	option = &dhcp_option_codes[option_name_slots[option_name_hash(name, OPTION_NAME_SEED) &
+						      (OPTION_NAME_SLOTS - 1)]];
+	if (!option->code || strcasecmp(option->name, name)) return NULL;
+	return option;
+}
+
+
+/* Index the options of a received packet in one pass, following the
+ * overload option into the file and sname fields. The first option with
+ * a code is the one indexed. Returns -1 if an option runs past the end of
+ * its field, or a field has no end option. */
+int index_options(struct option_index *index, struct dhcpMessage *packet)
+{
+	uint8_t *field = packet->options;
+	int length = sizeof(packet->options);
+	int i = 0, over = 0, curr = OPTION_FIELD;
+
+	memset(index->data, 0, sizeof(index->data));
+	index->packet = packet;
+	while (i < length) {
+		if (field[i + OPT_CODE] == DHCP_PADDING) {
 			i++;
-			break;
-		case DHCP_OPTION_OVER:
-			if (i + 1 + optionptr[i + OPT_LEN] >= length) {
-				LOG(LOG_WARNING, "bogus packet, option fields too long.");
-				return NULL;
-			}
-			over = optionptr[i + 3];
-			i += optionptr[OPT_LEN] + 2;
-			break;
-		case DHCP_END:
+			continue;
+		}
+		if (field[i + OPT_CODE] == DHCP_END) {
 			if (curr == OPTION_FIELD && over & FILE_FIELD) {
-				optionptr = packet->file;
-				i = 0;
-				length = 128;
+				field = packet->file;
+				length = sizeof(packet->file);
 				curr = FILE_FIELD;
-			} else if (curr == FILE_FIELD && over & SNAME_FIELD) {
-				optionptr = packet->sname;
-				i = 0;
-				length = 64;
+			} else if (curr != SNAME_FIELD && over & SNAME_FIELD) {
+				field = packet->sname;
+				length = sizeof(packet->sname);
 				curr = SNAME_FIELD;
-			} else done = 1;
-			break;
-		default:
-			i += optionptr[OPT_LEN + i] + 2;
+			} else return 0;
+			i = 0;
+			continue;
 		}
+
+		if (i + OPT_DATA > length || i + OPT_DATA + field[i + OPT_LEN] > length) break;
+		if (field[i + OPT_CODE] == DHCP_OPTION_OVER && curr == OPTION_FIELD)
+			over = field[i + OPT_DATA];
+		if (!index->data[field[i + OPT_CODE]])
+			index->data[field[i + OPT_CODE]] = field + i + OPT_DATA - (uint8_t *) packet;
+		i += field[i + OPT_LEN] + 2;
 	}
-	return NULL;
+
+	LOG(LOG_WARNING, "bogus packet, option fields too long.");
+	return -1;
 }
 
 
-/* return the position of the 'end' option (no bounds checking) */
-int end_option(uint8_t *optionptr)
+/* the data of option code in an indexed packet, NULL if it isn't there (warning, not aligned) */
+uint8_t *get_option(struct option_index *index, int code)
 {
-	int i = 0;
+	return index->data[code] ? (uint8_t *) index->packet + index->data[code] : NULL;
+}
+
 
-	while (optionptr[i] != DHCP_END) {
-		if (optionptr[i] == DHCP_PADDING) i++;
-		else i += optionptr[i + OPT_LEN] + 2;
+/* start writing options into an empty options field of size bytes */
+void start_options(struct option_writer *opts, uint8_t *optionptr, int size)
+{
+	opts->options = optionptr;
+	opts->end = 0;
+	opts->size = size;
+	optionptr[0] = DHCP_END;
+}
+
+
+/* Append option code with len bytes of data, and move the end option past
+ * it. Returns where the data goes, NULL if it doesn't fit. */
+uint8_t *put_option(struct option_writer *opts, uint8_t code, int len)
+{
+	uint8_t *option = opts->options + opts->end;
+
+	/* option code/length + data + end option */
+	if (len + 2 + 1 >= opts->size - opts->end) {
+		LOG(LOG_ERR, "Option 0x%02x did not fit into the packet!", code);
+		return NULL;
 	}
-	return i;
+	DEBUG(LOG_INFO, "adding option 0x%02x", code);
+	option[OPT_CODE] = code;
+	option[OPT_LEN] = len;
+	opts->end += len + 2;
+	opts->options[opts->end] = DHCP_END;
+	return option + OPT_DATA;
 }
 
 
-/* add an option string to the options (an option string contains an option code,
- * length, then data) */
-int add_option_string(uint8_t *optionptr, uint8_t *string)
+/* append an option string (an option code, length, then data) */
+int put_option_string(struct option_writer *opts, uint8_t *string)
 {
-	int end = end_option(optionptr);
+	uint8_t *data;
 
-	/* end position + string length + option code/length + end option */
-	if (end + string[OPT_LEN] + 2 + 1 >= 308) {
-		LOG(LOG_ERR, "Option 0x%02x did not fit into the packet!", string[OPT_CODE]);
+	if (!(data = put_option(opts, string[OPT_CODE], string[OPT_LEN])))
 		return 0;
-	}
-	DEBUG(LOG_INFO, "adding option 0x%02x", string[OPT_CODE]);
-	memcpy(optionptr + end, string, string[OPT_LEN] + 2);
-	optionptr[end + string[OPT_LEN] + 2] = DHCP_END;
+	memcpy(data, string + OPT_DATA, string[OPT_LEN]);
 	return string[OPT_LEN] + 2;
 }
 
 
-/* add a one to four byte option to a packet */
-int add_simple_option(uint8_t *optionptr, uint8_t code, uint32_t data)
+/* the data length of a one to four byte option, 0 if it isn't one */
+static int simple_length(uint8_t code)
 {
-	struct dhcp_option *dh;
-
-	for (dh=dhcp_options; dh->code; dh++) {
-		if (dh->code == code) {
-			uint8_t option[6], len;
-
-			option[OPT_CODE] = code;
-			len = option_lengths[dh->flags & TYPE_MASK];
-			option[OPT_LEN] = len;
-			if (__BYTE_ORDER == __BIG_ENDIAN)
-				data <<= 8 * (4 - len);
-			/* This memcpy is for broken processors which can't
-			 * handle a simple unaligned 32-bit assignment */
-			memcpy(&option[OPT_DATA], &data, 4);
-			return add_option_string(optionptr, option);
-		}
-	}
+	return option_lengths[dhcp_option_codes[code].flags & TYPE_MASK];
+}
 
-	DEBUG(LOG_ERR, "Could not add option 0x%02x", code);
-	return 0;
+
+/* append a one to four byte option */
+int put_simple_option(struct option_writer *opts, uint8_t code, uint32_t data)
+{
+	uint8_t *option;
+	int len;
+
+	if (!(len = simple_length(code))) {
+		DEBUG(LOG_ERR, "Could not add option 0x%02x", code);
+		return 0;
+	}
+	if (!(option = put_option(opts, code, len)))
+		return 0;
+	if (__BYTE_ORDER == __BIG_ENDIAN)
+		data <<= 8 * (4 - len);
+	/* This memcpy is for broken processors which can't
+	 * handle a simple unaligned 32-bit assignment */
+	memcpy(option, &data, len);
+	return len + 2;
 }
+
@@ -28,11 +28,30 @@ struct dhcp_option {
 };
 
 extern struct dhcp_option dhcp_options[];
+extern struct dhcp_option dhcp_option_codes[256];
 extern int option_lengths[];
 
-uint8_t *get_option(struct dhcpMessage *packet, int code);
-int end_option(uint8_t *optionptr);
-int add_option_string(uint8_t *optionptr, uint8_t *string);
-int add_simple_option(uint8_t *optionptr, uint8_t code, uint32_t data);
+/* Where the options of a received packet are, so that finding one doesn't
+ * take a walk over all three fields the options can be in */
+struct option_index {
+	struct dhcpMessage *packet;
+	uint16_t data[256];		/* offset of each option's data in packet, 0 if it isn't there */
+};
+
+/* Where the next option of an options field goes, so that appending one
+ * doesn't have to look for the end option */
+struct option_writer {
+	uint8_t *options;
+	int end;			/* offset of the end option */
+	int size;			/* of the options field */
+};
+
+struct dhcp_option *option_by_name(const char *name);
+int index_options(struct option_index *index, struct dhcpMessage *packet);
+uint8_t *get_option(struct option_index *index, int code);
+void start_options(struct option_writer *opts, uint8_t *optionptr, int size);
+uint8_t *put_option(struct option_writer *opts, uint8_t code, int len);
+int put_option_string(struct option_writer *opts, uint8_t *string);
+int put_simple_option(struct option_writer *opts, uint8_t code, uint32_t data);
 
 #endif
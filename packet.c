@@ -13,14 +13,19 @@
 #include <linux/if_ether.h>
 #endif
 #include <errno.h>
+#include <stdlib.h>
+#include <linux/filter.h>
 
 #include "common.h"
 #include "packet.h"
 #include "dhcpd.h"
 #include "options.h"
+#include "uring.h"
 
 
-void init_header(struct dhcpMessage *packet, char type)
+/* fill in the header of a packet, and start its options with the message
+ * type, to be appended to through opts */
+void init_header(struct dhcpMessage *packet, char type, struct option_writer *opts)
 {
 	memset(packet, 0, sizeof(struct dhcpMessage));
 	switch (type) {
@@ -38,36 +43,32 @@ void init_header(struct dhcpMessage *packet, char type)
 	packet->htype = ETH_10MB;
 	packet->hlen = ETH_10MB_LEN;
 	packet->cookie = htonl(DHCP_MAGIC);
-	packet->options[0] = DHCP_END;
-	add_simple_option(packet->options, DHCP_MESSAGE_TYPE, type);
+	start_options(opts, packet->options, sizeof(packet->options));
+	put_simple_option(opts, DHCP_MESSAGE_TYPE, type);
 }
 
 
-/* read a packet from socket fd, return -1 on read error, -2 on packet error */
-int get_packet(struct dhcpMessage *packet, int fd)
+/* check a packet that was just read and index its options into options,
+ * -2 if it is not a DHCP message */
+static int check_packet(struct dhcpMessage *packet, struct option_index *options, int bytes)
 {
 	static const char broken_vendors[][8] = {
 		"MSFT 98",
 		""
 	};
-	int bytes;
 	int i;
 	char unsigned *vendor;
 
-	memset(packet, 0, sizeof(struct dhcpMessage));
-	bytes = read(fd, packet, sizeof(struct dhcpMessage));
-	if (bytes < 0) {
-		DEBUG(LOG_INFO, "couldn't read on listening socket, ignoring");
-		return -1;
-	}
-
 	if (ntohl(packet->cookie) != DHCP_MAGIC) {
 		LOG(LOG_ERR, "received bogus message, ignoring");
 		return -2;
 	}
 	DEBUG(LOG_INFO, "Received a packet");
 
-	if (packet->op == BOOTREQUEST && (vendor = get_option(packet, DHCP_VENDOR))) {
+	if (index_options(options, packet) < 0)
+		return -2;
+
+	if (packet->op == BOOTREQUEST && (vendor = get_option(options, DHCP_VENDOR))) {
 		for (i = 0; broken_vendors[i][0]; i++) {
 			if (vendor[OPT_LEN - 2] == (uint8_t) strlen(broken_vendors[i]) &&
 			    !strncmp((char*)vendor, broken_vendors[i], vendor[OPT_LEN - 2])) {
@@ -82,6 +83,94 @@ int get_packet(struct dhcpMessage *packet, int fd)
 }
 
 
+/* read a packet from socket fd and index its options, return -1 on read
+ * error, -2 on packet error */
+int get_packet(struct dhcpMessage *packet, struct option_index *options, int fd)
+{
+	int bytes;
+
+	memset(packet, 0, sizeof(struct dhcpMessage));
+	bytes = read(fd, packet, sizeof(struct dhcpMessage));
+	if (bytes < 0) {
+		DEBUG(LOG_INFO, "couldn't read on listening socket, ignoring");
+		return -1;
+	}
+
+	return check_packet(packet, options, bytes);
+}
+
+
+/* Read up to max packets that are already queued on fd with one
+ * recvmmsg(), leaving the length of each (-2 on a packet error) in
+ * bytes and its options indexed in options. Returns the number read, 0 if none were waiting, or -1 on a
+ * read error. Kernels without recvmmsg get one packet at a time. */
+int get_packets(struct dhcpMessage *packets, struct option_index *options, int *bytes, int max, int fd)
+{
+	static __thread struct mmsghdr *msgs;
+	static __thread struct iovec *iovs;
+	static __thread int allocated;
+	static __thread int have_mmsg = 1;
+	int i, n;
+
+	if (max > allocated) {
+		free(msgs);
+		free(iovs);
+		msgs = xcalloc(max, sizeof(struct mmsghdr));
+		iovs = xcalloc(max, sizeof(struct iovec));
+		allocated = max;
+	}
+
+	if (!have_mmsg) {
+		if ((bytes[0] = get_packet(packets, options, fd)) == -1) return -1;
+		return 1;
+	}
+
+	for (i = 0; i < max; i++) {
+		iovs[i].iov_base = &packets[i];
+		iovs[i].iov_len = sizeof(struct dhcpMessage);
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	if ((n = recvmmsg(fd, msgs, max, MSG_DONTWAIT, NULL)) < 0) {
+		if (errno == ENOSYS) {
+			have_mmsg = 0;
+			return get_packets(packets, options, bytes, max, fd);
+		}
+		if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+		DEBUG(LOG_INFO, "couldn't read on listening socket, ignoring");
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		/* options are parsed up to the end of the buffer, clear what wasn't read */
+		memset((uint8_t *) &packets[i] + msgs[i].msg_len, 0,
+		       sizeof(struct dhcpMessage) - msgs[i].msg_len);
+		bytes[i] = check_packet(&packets[i], &options[i], msgs[i].msg_len);
+	}
+	return n;
+}
+
+
+#ifdef UDHCP_IO_URING
+/* Like get_packets(), for the packets the ring has received on fd, which
+ * are left where they were received: packets points into the ring's
+ * buffers until uring_recycle(). */
+int get_ring_packets(struct dhcpMessage **packets, struct option_index *options, int *bytes,
+		     int max, int fd)
+{
+	int i, n;
+
+	n = uring_received(packets, bytes, max, fd);
+	for (i = 0; i < n; i++) {
+		memset((uint8_t *) packets[i] + bytes[i], 0, sizeof(struct dhcpMessage) - bytes[i]);
+		bytes[i] = check_packet(packets[i], &options[i], bytes[i]);
+	}
+	return n;
+}
+#endif
+
+
 uint16_t checksum(void *addr, int count)
 {
 	/* Compute Internet Checksum for "count" bytes
@@ -112,6 +201,64 @@ uint16_t checksum(void *addr, int count)
 }
 
 
+/* Fill in the ip/udp header in front of a copy of payload */
+void make_udp_packet(struct udp_dhcp_packet *packet, struct dhcpMessage *payload,
+		     uint32_t source_ip, int source_port, uint32_t dest_ip, int dest_port)
+{
+	memset(packet, 0, sizeof(struct udp_dhcp_packet));
+
+	packet->ip.protocol = IPPROTO_UDP;
+	packet->ip.saddr = source_ip;
+	packet->ip.daddr = dest_ip;
+	packet->udp.source = htons(source_port);
+	packet->udp.dest = htons(dest_port);
+	packet->udp.len = htons(sizeof(packet->udp) + sizeof(struct dhcpMessage)); /* cheat on the psuedo-header */
+	packet->ip.tot_len = packet->udp.len;
+	memcpy(&(packet->data), payload, sizeof(struct dhcpMessage));
+	packet->udp.check = checksum(packet, sizeof(struct udp_dhcp_packet));
+
+	packet->ip.tot_len = htons(sizeof(struct udp_dhcp_packet));
+	packet->ip.ihl = sizeof(packet->ip) >> 2;
+	packet->ip.version = IPVERSION;
+	packet->ip.ttl = IPDEFTTL;
+	packet->ip.check = checksum(&(packet->ip), sizeof(packet->ip));
+}
+
+
+/* The packet socket replies go out on, one for each thread. It is opened
+ * with no protocol so nothing is ever queued to it, each frame names its
+ * interface and hardware address in its sockaddr_ll, and it is only
+ * reopened after an error. */
+static __thread int raw_fd = -1;
+
+static int raw_socket(void)
+{
+	if (raw_fd < 0 && (raw_fd = socket(PF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0)
+		DEBUG(LOG_ERR, "socket call failed: %m");
+	return raw_fd;
+}
+
+
+static void raw_error(void)
+{
+	DEBUG(LOG_ERR, "write on socket failed: %m");
+	if (errno == EINTR || errno == EAGAIN || errno == ENOBUFS) return;
+	close(raw_fd);
+	raw_fd = -1;
+}
+
+
+static void fill_dest(struct sockaddr_ll *dest, uint8_t *dest_arp, int ifindex)
+{
+	memset(dest, 0, sizeof(struct sockaddr_ll));
+	dest->sll_family = AF_PACKET;
+	dest->sll_protocol = htons(ETH_P_IP);
+	dest->sll_ifindex = ifindex;
+	dest->sll_halen = 6;
+	memcpy(dest->sll_addr, dest_arp, 6);
+}
+
+
 /* Construct a ip/udp header for a packet, and specify the source and dest hardware address */
 int raw_packet(struct dhcpMessage *payload, uint32_t source_ip, int source_port,
 		   uint32_t dest_ip, int dest_port, uint8_t *dest_arp, int ifindex)
@@ -121,46 +268,70 @@ int raw_packet(struct dhcpMessage *payload, uint32_t source_ip, int source_port,
 	struct sockaddr_ll dest;
 	struct udp_dhcp_packet packet;
 
-	if ((fd = socket(PF_PACKET, SOCK_DGRAM, htons(ETH_P_IP))) < 0) {
-		DEBUG(LOG_ERR, "socket call failed: %m");
+	if ((fd = raw_socket()) < 0)
 		return -1;
-	}
 
-	memset(&dest, 0, sizeof(dest));
-	memset(&packet, 0, sizeof(packet));
+	fill_dest(&dest, dest_arp, ifindex);
+	make_udp_packet(&packet, payload, source_ip, source_port, dest_ip, dest_port);
 
-	dest.sll_family = AF_PACKET;
-	dest.sll_protocol = htons(ETH_P_IP);
-	dest.sll_ifindex = ifindex;
-	dest.sll_halen = 6;
-	memcpy(dest.sll_addr, dest_arp, 6);
-	if (bind(fd, (struct sockaddr *)&dest, sizeof(struct sockaddr_ll)) < 0) {
-		DEBUG(LOG_ERR, "bind call failed: %m");
-		close(fd);
-		return -1;
+	result = sendto(fd, &packet, sizeof(struct udp_dhcp_packet), 0, (struct sockaddr *) &dest, sizeof(dest));
+	if (result <= 0) raw_error();
+	return result;
+}
+
+
+/* Send msgs with sendmmsg(), again from the first one left over until all
+ * are gone, or one at a time on kernels without it, through the ring if
+ * there is one. Returns the number sent, fewer than count only when a send
+ * failed, errno telling why. */
+static int send_msgs(int fd, struct mmsghdr *msgs, int count)
+{
+	static __thread int have_mmsg = 1;
+	int sent = 0, n;
+
+#ifdef UDHCP_IO_URING
+	if (uring_active())
+		return uring_sendmsgs(fd, msgs, count);
+#endif
+
+	while (have_mmsg && sent < count) {
+		if ((n = sendmmsg(fd, msgs + sent, count - sent, 0)) > 0)
+			sent += n;
+		else if (n < 0 && errno == ENOSYS)
+			have_mmsg = 0;
+		else return sent;
 	}
 
-	packet.ip.protocol = IPPROTO_UDP;
-	packet.ip.saddr = source_ip;
-	packet.ip.daddr = dest_ip;
-	packet.udp.source = htons(source_port);
-	packet.udp.dest = htons(dest_port);
-	packet.udp.len = htons(sizeof(packet.udp) + sizeof(struct dhcpMessage)); /* cheat on the psuedo-header */
-	packet.ip.tot_len = packet.udp.len;
-	memcpy(&(packet.data), payload, sizeof(struct dhcpMessage));
-	packet.udp.check = checksum(&packet, sizeof(struct udp_dhcp_packet));
+	for (; sent < count; sent++)
+		if (sendmsg(fd, &msgs[sent].msg_hdr, 0) < 0) break;
+	return sent;
+}
 
-	packet.ip.tot_len = htons(sizeof(struct udp_dhcp_packet));
-	packet.ip.ihl = sizeof(packet.ip) >> 2;
-	packet.ip.version = IPVERSION;
-	packet.ip.ttl = IPDEFTTL;
-	packet.ip.check = checksum(&(packet.ip), sizeof(packet.ip));
 
-	result = sendto(fd, &packet, sizeof(struct udp_dhcp_packet), 0, (struct sockaddr *) &dest, sizeof(dest));
-	if (result <= 0) {
-		DEBUG(LOG_ERR, "write on socket failed: %m");
+/* Send count ready built ip/udp packets out of ifindex, each to its own
+ * hardware address. Returns the number sent, fewer than count on error. */
+int raw_packets(struct udp_dhcp_packet *packets, uint8_t (*dest_arp)[6], int count, int ifindex)
+{
+	struct mmsghdr msgs[count];
+	struct iovec iovs[count];
+	struct sockaddr_ll dests[count];
+	int fd, i, result;
+
+	if ((fd = raw_socket()) < 0)
+		return 0;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < count; i++) {
+		fill_dest(&dests[i], dest_arp[i], ifindex);
+		iovs[i].iov_base = &packets[i];
+		iovs[i].iov_len = sizeof(struct udp_dhcp_packet);
+		msgs[i].msg_hdr.msg_name = &dests[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_ll);
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
 	}
-	close(fd);
+
+	if ((result = send_msgs(fd, msgs, count)) < count) raw_error();
 	return result;
 }
 
@@ -205,3 +376,89 @@ int kernel_packet(struct dhcpMessage *payload, uint32_t source_ip, int source_po
 	close(fd);
 	return result;
 }
+
+
+/* The udp socket kernel_packets() sends on, one for each thread. It is
+ * bound to the wildcard address, so any socket listening on the port
+ * outranks it for unicasts, and on no interface, so replies are routed
+ * like any other packet. A filter drops the broadcasts it still gets. */
+static __thread int kernel_fd = -1;
+
+static int kernel_socket(int port)
+{
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_RET | BPF_K, 0),
+	};
+	struct sock_fprog prog = {1, code};
+	struct sockaddr_in addr;
+	int fd, n = 1;
+
+	if (kernel_fd >= 0) return kernel_fd;
+
+	if ((fd = socket(PF_INET, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP)) < 0) {
+		DEBUG(LOG_ERR, "socket call failed: %m");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = INADDR_ANY;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char *) &n, sizeof(n)) == -1 ||
+	    setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) == -1 ||
+	    bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		DEBUG(LOG_ERR, "couldn't set up the socket to send on: %m");
+		close(fd);
+		return -1;
+	}
+	return kernel_fd = fd;
+}
+
+
+/* Send count payloads from source_port through the kernel, each to
+ * dest_port on its own address. IP_PKTINFO gives them source_ip as their
+ * source address. Returns the number sent, fewer than count on error. */
+int kernel_packets(struct dhcpMessage *payloads, uint32_t *dest_ips, int count,
+		   uint32_t source_ip, int source_port, int dest_port)
+{
+	struct mmsghdr msgs[count];
+	struct iovec iovs[count];
+	struct sockaddr_in dests[count];
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(struct in_pktinfo))];
+	} control[count];
+	struct cmsghdr *cmsg;
+	struct in_pktinfo *pktinfo;
+	int fd, i;
+
+	if ((fd = kernel_socket(source_port)) < 0)
+		return 0;
+
+	memset(msgs, 0, sizeof(msgs));
+	memset(dests, 0, sizeof(dests));
+	memset(control, 0, sizeof(control));
+	for (i = 0; i < count; i++) {
+		dests[i].sin_family = AF_INET;
+		dests[i].sin_port = htons(dest_port);
+		dests[i].sin_addr.s_addr = dest_ips[i];
+		iovs[i].iov_base = &payloads[i];
+		iovs[i].iov_len = sizeof(struct dhcpMessage);
+		msgs[i].msg_hdr.msg_name = &dests[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_control = control[i].buf;
+		msgs[i].msg_hdr.msg_controllen = sizeof(control[i].buf);
+
+		cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+		cmsg->cmsg_level = IPPROTO_IP;
+		cmsg->cmsg_type = IP_PKTINFO;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+		pktinfo = (struct in_pktinfo *) CMSG_DATA(cmsg);
+		pktinfo->ipi_spec_dst.s_addr = source_ip;
+	}
+
+	return send_msgs(fd, msgs, count);
+}
@@ -29,13 +29,26 @@ struct udp_dhcp_packet {
 	struct dhcpMessage data;
 };
 
-void init_header(struct dhcpMessage *packet, char type);
-int get_packet(struct dhcpMessage *packet, int fd);
+struct option_writer;
+struct option_index;
+
+void init_header(struct dhcpMessage *packet, char type, struct option_writer *opts);
+int get_packet(struct dhcpMessage *packet, struct option_index *options, int fd);
+int get_packets(struct dhcpMessage *packets, struct option_index *options, int *bytes, int max, int fd);
+#ifdef UDHCP_IO_URING
+int get_ring_packets(struct dhcpMessage **packets, struct option_index *options, int *bytes,
+		     int max, int fd);
+#endif
 uint16_t checksum(void *addr, int count);
 int raw_packet(struct dhcpMessage *payload, uint32_t source_ip, int source_port,
 		   uint32_t dest_ip, int dest_port, uint8_t *dest_arp, int ifindex);
 int kernel_packet(struct dhcpMessage *payload, uint32_t source_ip, int source_port,
 		   uint32_t dest_ip, int dest_port);
+void make_udp_packet(struct udp_dhcp_packet *packet, struct dhcpMessage *payload,
+		     uint32_t source_ip, int source_port, uint32_t dest_ip, int dest_port);
+int raw_packets(struct udp_dhcp_packet *packets, uint8_t (*dest_arp)[6], int count, int ifindex);
+int kernel_packets(struct dhcpMessage *payloads, uint32_t *dest_ips, int count,
+		   uint32_t source_ip, int source_port, int dest_port);
 
 
 #endif
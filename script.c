@@ -34,6 +34,7 @@
 #include "dhcpd.h"
 #include "dhcpc.h"
 #include "script.h"
+#include "events.h"
 
 /* get a rough idea of how long an option will be (rounding up...) */
 static const int max_option_length[] = {
@@ -133,9 +134,10 @@ static void fill_options(char *dest, uint8_t *option, struct dhcp_option *type_p
 }
 
 
-/* put all the parameters into an environment */
-static char **fill_envp(struct dhcpMessage *packet)
+/* put all the parameters of an indexed packet into an environment */
+static char **fill_envp(struct option_index *options)
 {
+	struct dhcpMessage *packet = options ? options->packet : NULL;
 	int num_options = 0;
 	int i, j;
 	char **envp;
@@ -147,13 +149,13 @@ static char **fill_envp(struct dhcpMessage *packet)
 		num_options = 0;
 	else {
 		for (i = 0; dhcp_options[i].code; i++)
-			if (get_option(packet, dhcp_options[i].code)) {
+			if (get_option(options, dhcp_options[i].code)) {
 				num_options++;
 				if (dhcp_options[i].code == DHCP_SUBNET)
 					num_options++; /* for mton */
 			}
 		if (packet->siaddr) num_options++;
-		if ((temp = get_option(packet, DHCP_OPTION_OVER)))
+		if ((temp = get_option(options, DHCP_OPTION_OVER)))
 			over = *temp;
 		if (!(over & FILE_FIELD) && packet->file[0]) num_options++;
 		if (!(over & SNAME_FIELD) && packet->sname[0]) num_options++;
@@ -173,7 +175,7 @@ static char **fill_envp(struct dhcpMessage *packet)
 
 
 	for (i = 0; dhcp_options[i].code; i++) {
-		if (!(temp = get_option(packet, dhcp_options[i].code)))
+		if (!(temp = get_option(options, dhcp_options[i].code)))
 			continue;
 		envp[j] = xmalloc(upper_length(temp[OPT_LEN - 2],
 			dhcp_options[i].flags & TYPE_MASK) + strlen(dhcp_options[i].name) + 2);
@@ -204,7 +206,7 @@ static char **fill_envp(struct dhcpMessage *packet)
 
 
 /* Call a script with a par file and env vars */
-void run_script(struct dhcpMessage *packet, const char *name)
+void run_script(struct option_index *options, const char *name)
 {
 	int pid;
 	char **envp, **curr;
@@ -214,7 +216,7 @@ void run_script(struct dhcpMessage *packet, const char *name)
 
 	DEBUG(LOG_INFO, "vforking and execle'ing %s", client_config.script);
 
-	envp = fill_envp(packet);
+	envp = fill_envp(options);
 	/* call script */
 	pid = vfork();
 	if (pid) {
@@ -224,6 +226,7 @@ void run_script(struct dhcpMessage *packet, const char *name)
 		return;
 	} else if (pid == 0) {
 		/* close fd's? */
+		udhcp_ev_child();
 
 		/* exec script */
 		execle(client_config.script, client_config.script,
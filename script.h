@@ -1,6 +1,8 @@
 #ifndef _SCRIPT_H
 #define _SCRIPT_H
 
-extern void run_script(struct dhcpMessage *packet, const char *name);
+struct option_index;
+
+extern void run_script(struct option_index *options, const char *name);
 
 #endif
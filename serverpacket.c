@@ -30,14 +30,51 @@
 #include "dhcpd.h"
 #include "options.h"
 #include "static_leases.h"
+#include "workers.h"
+#include "files.h"
+
+/* Replies are queued while a batch of requests is handled and sent
+ * together by flush_packets(), one sendmmsg() per kind of socket, before
+ * the server moves on to another interface. Each worker thread has
+ * queues of its own. */
+static __thread struct udp_dhcp_packet client_queue[RECV_BATCH];
+static __thread uint8_t client_arp[RECV_BATCH][6];
+static __thread int client_queued;
+
+static __thread struct dhcpMessage relay_queue[RECV_BATCH];
+static __thread uint32_t relay_ip[RECV_BATCH];
+static __thread int relay_queued;
+
+
+/* send everything that has been queued, once the journal has the leases
+ * it hands out on disk. Replies to relays are routed to their giaddr on
+ * whatever interface reaches it */
+void flush_packets(void)
+{
+	int sent;
+
+	sync_journal();
+	if (client_queued &&
+	    (sent = raw_packets(client_queue, client_arp, client_queued,
+				server_config.ifindex)) < client_queued)
+		LOG(LOG_ERR, "couldn't send %d replies to clients", client_queued - sent);
+	if (relay_queued &&
+	    (sent = kernel_packets(relay_queue, relay_ip, relay_queued,
+				   server_config.server, SERVER_PORT, SERVER_PORT)) < relay_queued)
+		LOG(LOG_ERR, "couldn't send %d replies to relays", relay_queued - sent);
+	client_queued = relay_queued = 0;
+}
+
 
 /* send a packet to giaddr using the kernel ip stack */
 static int send_packet_to_relay(struct dhcpMessage *payload)
 {
 	DEBUG(LOG_INFO, "Forwarding packet to relay");
 
-	return kernel_packet(payload, server_config.server, SERVER_PORT,
-			payload->giaddr, SERVER_PORT);
+	if (relay_queued == RECV_BATCH) flush_packets();
+	memcpy(&relay_queue[relay_queued], payload, sizeof(struct dhcpMessage));
+	relay_ip[relay_queued++] = payload->giaddr;
+	return sizeof(struct dhcpMessage);
 }
 
 
@@ -64,12 +101,16 @@ static int send_packet_to_client(struct dhcpMessage *payload, int force_broadcas
 		ciaddr = payload->yiaddr;
 		chaddr = payload->chaddr;
 	}
-	return raw_packet(payload, server_config.server, SERVER_PORT,
-			ciaddr, CLIENT_PORT, chaddr, server_config.ifindex);
+
+	if (client_queued == RECV_BATCH) flush_packets();
+	make_udp_packet(&client_queue[client_queued], payload, server_config.server, SERVER_PORT,
+			ciaddr, CLIENT_PORT);
+	memcpy(client_arp[client_queued++], chaddr, 6);
+	return sizeof(struct udp_dhcp_packet);
 }
 
 
-/* send a dhcp packet, if force broadcast is set, the packet will be broadcast to the client */
+/* queue a dhcp packet, if force broadcast is set, the packet will be broadcast to the client */
 static int send_packet(struct dhcpMessage *payload, int force_broadcast)
 {
 	int ret;
@@ -81,15 +122,66 @@ static int send_packet(struct dhcpMessage *payload, int force_broadcast)
 }
 
 
-static void init_packet(struct dhcpMessage *packet, struct dhcpMessage *oldpacket, char type)
+/* Encode the options of a kind of reply, with room for the lease time if
+ * it has one, and the configured options unless it is a NAK */
+static void encode_reply(struct reply_options *reply, char type, int lease_time)
+{
+	struct option_writer opts;
+	struct option_set *curr;
+	uint8_t *lease;
+
+	start_options(&opts, reply->options, sizeof(reply->options));
+	put_simple_option(&opts, DHCP_MESSAGE_TYPE, type);
+	put_simple_option(&opts, DHCP_SERVER_ID, server_config.server);
+
+	reply->lease_time = 0;
+	if (lease_time && (lease = put_option(&opts, DHCP_LEASE_TIME, 4)))
+		reply->lease_time = lease - reply->options;
+
+	if (type != DHCPNAK)
+		for (curr = server_config.options; curr; curr = curr->next)
+			if (curr->data[OPT_CODE] != DHCP_LEASE_TIME)
+				put_option_string(&opts, curr->data);
+
+	reply->length = opts.end + 1;
+}
+
+
+/* Encode the options of the replies of the current interface, once its
+ * address is known. The options don't change, so each reply is then a
+ * copy of these and its lease time. */
+void encode_replies(void)
 {
-	init_header(packet, type);
+	encode_reply(&server_config.offer_options, DHCPOFFER, 1);
+	encode_reply(&server_config.ack_options, DHCPACK, 1);
+	encode_reply(&server_config.inform_options, DHCPACK, 0);
+	encode_reply(&server_config.nak_options, DHCPNAK, 0);
+}
+
+
+static void init_packet(struct dhcpMessage *packet, struct dhcpMessage *oldpacket,
+			struct reply_options *reply)
+{
+	memset(packet, 0, sizeof(struct dhcpMessage));
+	packet->op = BOOTREPLY;
+	packet->htype = ETH_10MB;
+	packet->hlen = ETH_10MB_LEN;
+	packet->cookie = htonl(DHCP_MAGIC);
+	memcpy(packet->options, reply->options, reply->length);
+
 	packet->xid = oldpacket->xid;
 	memcpy(packet->chaddr, oldpacket->chaddr, 16);
 	packet->flags = oldpacket->flags;
 	packet->giaddr = oldpacket->giaddr;
 	packet->ciaddr = oldpacket->ciaddr;
-	add_simple_option(packet->options, DHCP_SERVER_ID, server_config.server);
+}
+
+
+/* fill in the lease time of a reply made from reply */
+static void set_lease_time(struct dhcpMessage *packet, struct reply_options *reply, uint32_t lease_time)
+{
+	lease_time = htonl(lease_time);
+	memcpy(packet->options + reply->lease_time, &lease_time, 4);
 }
 
 
@@ -105,20 +197,19 @@ static void add_bootp_options(struct dhcpMessage *packet)
 
 
 /* send a DHCP OFFER to a DHCP DISCOVER */
-int sendOffer(struct dhcpMessage *oldpacket)
+int sendOffer(struct dhcpMessage *oldpacket, struct option_index *options)
 {
 	struct dhcpMessage packet;
-	struct dhcpOfferedAddr *lease = NULL;
+	uint32_t lease = 0;
 	uint32_t req_align, lease_time_align = server_config.lease;
 	uint8_t *req, *lease_time;
-	struct option_set *curr;
 	struct in_addr addr;
 
 	uint32_t static_lease_ip;
 
-	init_packet(&packet, oldpacket, DHCPOFFER);
+	init_packet(&packet, oldpacket, &server_config.offer_options);
 
-	static_lease_ip = getIpByMac(server_config.static_leases, oldpacket->chaddr);
+	static_lease_ip = getIpByMac(&server_config.static_leases, oldpacket->chaddr);
 
 	/* ADDME: if static, short circuit */
 	if(!static_lease_ip)
@@ -126,11 +217,11 @@ int sendOffer(struct dhcpMessage *oldpacket)
 	/* the client is in our lease/offered table */
 	if ((lease = find_lease_by_chaddr(oldpacket->chaddr))) {
 		if (!lease_expired(lease))
-			lease_time_align = lease->expires - time(0);
-		packet.yiaddr = lease->yiaddr;
+			lease_time_align = lease_expires(lease) - time(0);
+		packet.yiaddr = lease_yiaddr(lease);
 
 	/* Or the client has a requested ip */
-	} else if ((req = get_option(oldpacket, DHCP_REQUESTED_IP)) &&
+	} else if ((req = get_option(options, DHCP_REQUESTED_IP)) &&
 
 		   /* Don't look here (ugly hackish thing to do) */
 		   memcpy(&req_align, req, 4) &&
@@ -139,6 +230,9 @@ int sendOffer(struct dhcpMessage *oldpacket)
 		   ntohl(req_align) >= ntohl(server_config.start) &&
 		   ntohl(req_align) <= ntohl(server_config.end) &&
 
+		   /* and in the shard of this worker */
+		   owns_address(req_align) &&
+
 			!static_lease_ip &&  /* Check that its not a static lease */
 			/* and is not already taken/offered */
 		   ((!(lease = find_lease_by_yiaddr(req_align)) ||
@@ -154,6 +248,9 @@ int sendOffer(struct dhcpMessage *oldpacket)
 
 		/* try for an expired lease */
 		if (!packet.yiaddr) packet.yiaddr = find_address(1);
+
+		/* or for one from the shard of another worker */
+		if (!packet.yiaddr) packet.yiaddr = borrow_address();
 	}
 
 	if(!packet.yiaddr) {
@@ -166,7 +263,7 @@ int sendOffer(struct dhcpMessage *oldpacket)
 		return -1;
 	}
 
-	if ((lease_time = get_option(oldpacket, DHCP_LEASE_TIME))) {
+	if ((lease_time = get_option(options, DHCP_LEASE_TIME))) {
 		memcpy(&lease_time_align, lease_time, 4);
 		lease_time_align = ntohl(lease_time_align);
 		if (lease_time_align > server_config.lease)
@@ -184,15 +281,7 @@ int sendOffer(struct dhcpMessage *oldpacket)
 		packet.yiaddr = static_lease_ip;
 	}
 
-	add_simple_option(packet.options, DHCP_LEASE_TIME, htonl(lease_time_align));
-
-	curr = server_config.options;
-	while (curr) {
-		if (curr->data[OPT_CODE] != DHCP_LEASE_TIME)
-			add_option_string(packet.options, curr->data);
-		curr = curr->next;
-	}
-
+	set_lease_time(&packet, &server_config.offer_options, lease_time_align);
 	add_bootp_options(&packet);
 
 	addr.s_addr = packet.yiaddr;
@@ -205,25 +294,24 @@ int sendNAK(struct dhcpMessage *oldpacket)
 {
 	struct dhcpMessage packet;
 
-	init_packet(&packet, oldpacket, DHCPNAK);
+	init_packet(&packet, oldpacket, &server_config.nak_options);
 
 	DEBUG(LOG_INFO, "sending NAK");
 	return send_packet(&packet, 1);
 }
 
 
-int sendACK(struct dhcpMessage *oldpacket, uint32_t yiaddr)
+int sendACK(struct dhcpMessage *oldpacket, struct option_index *options, uint32_t yiaddr)
 {
 	struct dhcpMessage packet;
-	struct option_set *curr;
 	uint8_t *lease_time;
 	uint32_t lease_time_align = server_config.lease;
 	struct in_addr addr;
 
-	init_packet(&packet, oldpacket, DHCPACK);
+	init_packet(&packet, oldpacket, &server_config.ack_options);
 	packet.yiaddr = yiaddr;
 
-	if ((lease_time = get_option(oldpacket, DHCP_LEASE_TIME))) {
+	if ((lease_time = get_option(options, DHCP_LEASE_TIME))) {
 		memcpy(&lease_time_align, lease_time, 4);
 		lease_time_align = ntohl(lease_time_align);
 		if (lease_time_align > server_config.lease)
@@ -232,15 +320,7 @@ int sendACK(struct dhcpMessage *oldpacket, uint32_t yiaddr)
 			lease_time_align = server_config.lease;
 	}
 
-	add_simple_option(packet.options, DHCP_LEASE_TIME, htonl(lease_time_align));
-
-	curr = server_config.options;
-	while (curr) {
-		if (curr->data[OPT_CODE] != DHCP_LEASE_TIME)
-			add_option_string(packet.options, curr->data);
-		curr = curr->next;
-	}
-
+	set_lease_time(&packet, &server_config.ack_options, lease_time_align);
 	add_bootp_options(&packet);
 
 	addr.s_addr = packet.yiaddr;
@@ -258,17 +338,8 @@ int sendACK(struct dhcpMessage *oldpacket, uint32_t yiaddr)
 int send_inform(struct dhcpMessage *oldpacket)
 {
 	struct dhcpMessage packet;
-	struct option_set *curr;
-
-	init_packet(&packet, oldpacket, DHCPACK);
-
-	curr = server_config.options;
-	while (curr) {
-		if (curr->data[OPT_CODE] != DHCP_LEASE_TIME)
-			add_option_string(packet.options, curr->data);
-		curr = curr->next;
-	}
 
+	init_packet(&packet, oldpacket, &server_config.inform_options);
 	add_bootp_options(&packet);
 
 	return send_packet(&packet, 0);
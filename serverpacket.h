@@ -3,10 +3,14 @@
 
 #include "packet.h"
 
-int sendOffer(struct dhcpMessage *oldpacket);
+struct option_index;
+
+int sendOffer(struct dhcpMessage *oldpacket, struct option_index *options);
 int sendNAK(struct dhcpMessage *oldpacket);
-int sendACK(struct dhcpMessage *oldpacket, uint32_t yiaddr);
+int sendACK(struct dhcpMessage *oldpacket, struct option_index *options, uint32_t yiaddr);
 int send_inform(struct dhcpMessage *oldpacket);
+void flush_packets(void);
+void encode_replies(void);
 
 
 #endif
@@ -93,7 +93,9 @@ int read_interface(char *interface, int *ifindex, uint32_t *addr, uint8_t *arp)
 }
 
 
-int listen_socket(uint32_t ip, int port, char *inf)
+/* with reuseport set, the socket joins a group of sockets on the same
+ * port and interface that the kernel shares the requests out among */
+int listen_socket(uint32_t ip, int port, char *inf, int reuseport)
 {
 	struct ifreq interface;
 	int fd;
@@ -119,6 +121,10 @@ int listen_socket(uint32_t ip, int port, char *inf)
 		close(fd);
 		return -1;
 	}
+	if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char *) &n, sizeof(n)) == -1) {
+		close(fd);
+		return -1;
+	}
 
 	strncpy(interface.ifr_name, inf, IFNAMSIZ);
 	if (setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE,(char *)&interface, sizeof(interface)) < 0) {
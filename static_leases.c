@@ -14,101 +14,97 @@
 #include "static_leases.h"
 #include "dhcpd.h"
 
-/* Takes the address of the pointer to the static_leases linked list,
- *   Address to a 6 byte mac address
- *   Address to a 4 byte ip address */
-int addStaticLease(struct static_lease **lease_struct, uint8_t *mac, uint32_t *ip)
+
+static unsigned int hash_mac(struct static_lease_table *table, uint8_t *mac)
 {
+	uint32_t h = 2166136261UL; /* FNV-1a */
+	int i;
+
+	for (i = 0; i < 6; i++)
+		h = (h ^ mac[i]) * 16777619;
+	return h & table->mask;
+}
+
+
+static void hash_static_lease(struct static_lease_table *table, struct static_lease *lease)
+{
+	unsigned int i;
+
+	i = hash_mac(table, lease->mac);
+	lease->mac_next = table->by_mac[i];
+	table->by_mac[i] = lease;
+}
 
+
+/* double the hash table, rehashing in config file order so later
+ * leases still shadow earlier ones for the same mac */
+static void grow_static_leases(struct static_lease_table *table)
+{
 	struct static_lease *cur;
+	unsigned int size = table->mask ? 2 * (table->mask + 1) : 16;
+
+	free(table->by_mac);
+	table->by_mac = xcalloc(size, sizeof(struct static_lease *));
+	table->mask = size - 1;
+
+	for (cur = table->list; cur; cur = cur->next)
+		hash_static_lease(table, cur);
+}
+
+
+/* Takes the static lease table,
+ *   Address to a 6 byte mac address
+ *   A 4 byte ip address */
+int addStaticLease(struct static_lease_table *table, uint8_t *mac, uint32_t ip)
+{
 	struct static_lease *new_static_lease;
 
 	/* Build new node */
 	new_static_lease = xmalloc(sizeof(struct static_lease));
-	new_static_lease->mac = mac;
+	memcpy(new_static_lease->mac, mac, 6);
 	new_static_lease->ip = ip;
 	new_static_lease->next = NULL;
 
-	/* If it's the first node to be added... */
-	if(*lease_struct == NULL)
-	{
-		*lease_struct = new_static_lease;
-	}
-	else
-	{
-		cur = *lease_struct;
-		while(cur->next != NULL)
-		{
-			cur = cur->next;
-		}
-
-		cur->next = new_static_lease;
-	}
+	if (table->last)
+		table->last->next = new_static_lease;
+	else table->list = new_static_lease;
+	table->last = new_static_lease;
+
+	if (++table->count > table->mask)
+		grow_static_leases(table);
+	else hash_static_lease(table, new_static_lease);
 
 	return 1;
 
 }
 
 /* Check to see if a mac has an associated static lease */
-uint32_t getIpByMac(struct static_lease *lease_struct, void *arg)
+uint32_t getIpByMac(struct static_lease_table *table, void *arg)
 {
-	uint32_t return_ip;
-	struct static_lease *cur = lease_struct;
+	struct static_lease *cur;
 	uint8_t *mac = arg;
 
-	return_ip = 0;
+	if (!table->count) return 0;
 
-	while(cur != NULL)
-	{
+	for (cur = table->by_mac[hash_mac(table, mac)]; cur; cur = cur->mac_next)
 		/* If the client has the correct mac  */
-		if(memcmp(cur->mac, mac, 6) == 0)
-		{
-			return_ip = *(cur->ip);
-		}
+		if (memcmp(cur->mac, mac, 6) == 0)
+			return cur->ip;
 
-		cur = cur->next;
-	}
-
-	return return_ip;
-
-}
-
-/* Check to see if an ip is reserved as a static ip */
-uint32_t reservedIp(struct static_lease *lease_struct, uint32_t ip)
-{
-	struct static_lease *cur = lease_struct;
-
-	uint32_t return_val = 0;
-
-	while(cur != NULL)
-	{
-		/* If the client has the correct ip  */
-		if(*cur->ip == ip)
-			return_val = 1;
-
-		cur = cur->next;
-	}
-
-	return return_val;
+	return 0;
 
 }
 
 #ifdef UDHCP_DEBUG
 /* Print out static leases just to check what's going on */
-/* Takes the address of the pointer to the static_leases linked list */
-void printStaticLeases(struct static_lease **arg)
+/* Takes the static lease table */
+void printStaticLeases(struct static_lease_table *table)
 {
-	/* Get a pointer to the linked list */
-	struct static_lease *cur = *arg;
-
-	while(cur != NULL)
-	{
-		/* printf("PrintStaticLeases: Lease mac Address: %x\n", cur->mac); */
-		printf("PrintStaticLeases: Lease mac Value: %x\n", *(cur->mac));
-		/* printf("PrintStaticLeases: Lease ip Address: %x\n", cur->ip); */
-		printf("PrintStaticLeases: Lease ip Value: %x\n", *(cur->ip));
+	struct static_lease *cur;
 
-		cur = cur->next;
+	for (cur = table->list; cur; cur = cur->next) {
+		printf("PrintStaticLeases: Lease mac Value: %x\n", cur->mac[0]);
+		printf("PrintStaticLeases: Lease ip Value: %x\n", cur->ip);
 	}
 
 
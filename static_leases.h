@@ -6,17 +6,14 @@
 
 /* Config file will pass static lease info to this function which will add it
  * to a data structure that can be searched later */
-int addStaticLease(struct static_lease **lease_struct, uint8_t *mac, uint32_t *ip);
+int addStaticLease(struct static_lease_table *table, uint8_t *mac, uint32_t ip);
 
 /* Check to see if a mac has an associated static lease */
-uint32_t getIpByMac(struct static_lease *lease_struct, void *arg);
-
-/* Check to see if an ip is reserved as a static ip */
-uint32_t reservedIp(struct static_lease *lease_struct, uint32_t ip);
+uint32_t getIpByMac(struct static_lease_table *table, void *arg);
 
 #ifdef UDHCP_DEBUG
 /* Print out static leases just to check what's going on */
-void printStaticLeases(struct static_lease **lease_struct);
+void printStaticLeases(struct static_lease_table *table);
 #endif
 
 #endif
@@ -0,0 +1,360 @@
+/* uring.c
+ *
+ * io_uring backend for the server's packet i/o: a multishot receive stays
+ * posted on each listen socket, packets land in a ring of registered
+ * struct dhcpMessage buffers without a read per batch, and a batch of
+ * replies goes in with a single io_uring_enter(). Kernels older than 6.0
+ * don't get a ring, and the server keeps to recvmmsg() and sendmmsg().
+ *
+ * Licensed under the GPL v2 or later, see the file LICENSE in this tarball.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "common.h"
+#include "packet.h"
+#include "uring.h"
+
+#define URING_ENTRIES	64	/* submission queue entries */
+#define URING_BUFFERS	64	/* receive buffers, a power of 2 */
+#define URING_GROUP	0	/* the buffer group the receives pick from */
+#define URING_FAILED	16	/* sockets whose receive failed, not reported yet */
+
+/* user_data of a send, that of a receive is the socket it was posted on */
+#define SEND_DATA	(~(uint64_t) 0)
+
+/* Only the thread that set the ring up (the main loop) uses it, workers
+ * keep to the classic path */
+static __thread int ring_fd = -1;
+
+static unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array, sq_entries;
+static struct io_uring_sqe *sqes;
+static unsigned int *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_cqe *cqes;
+static unsigned int unsubmitted;
+
+static struct io_uring_buf_ring *buf_ring;
+static struct dhcpMessage *buffers;
+
+/* packets reaped from the completion queue but not handed out yet, in the
+ * order they arrived. Each holds a buffer, so there can't be more. */
+static struct {
+	int fd;
+	uint16_t bid;
+	int len;
+} received[URING_BUFFERS];
+static int nreceived;
+
+/* buffers handed out by the last uring_received() */
+static uint16_t lent[URING_BUFFERS];
+static int nlent;
+
+/* listen sockets whose receive ended on an error, with the error, until
+ * uring_received() reports it */
+static struct {
+	int fd;
+	int error;
+} failed[URING_FAILED];
+static int nfailed;
+static int receive_error;	/* the last of them, no socket is listened on after it */
+
+static int sends_pending, sends_done;
+
+
+static int enter(unsigned int submit, unsigned int wait)
+{
+	int n;
+
+	n = syscall(__NR_io_uring_enter, ring_fd, submit, wait,
+		    wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	if (n > 0) unsubmitted -= n;
+	return n;
+}
+
+
+/* A cleared submission queue entry, NULL if the queue is full even after
+ * submitting what is in it. Queued with push_sqe() once filled in. */
+static struct io_uring_sqe *get_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+
+	if (*sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries &&
+	    (enter(unsubmitted, 0) < 0 || *sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries))
+		return NULL;
+	sqe = &sqes[*sq_tail & *sq_mask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	return sqe;
+}
+
+
+static void push_sqe(void)
+{
+	unsigned int tail = *sq_tail;
+
+	sq_array[tail & *sq_mask] = tail & *sq_mask;
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+	unsubmitted++;
+}
+
+
+/* hand buffer bid back to the kernel to receive into */
+static void give_buffer(uint16_t bid)
+{
+	struct io_uring_buf *buf = &buf_ring->bufs[buf_ring->tail & (URING_BUFFERS - 1)];
+
+	buf->addr = (uintptr_t) &buffers[bid];
+	buf->len = sizeof(struct dhcpMessage);
+	buf->bid = bid;
+	__atomic_store_n(&buf_ring->tail, buf_ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+
+/* queue a multishot receive on fd, it stays posted until it runs out of buffers */
+static int post_recv(int fd)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!(sqe = get_sqe())) return -1;
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_GROUP;
+	sqe->user_data = fd;
+	push_sqe();
+	return 0;
+}
+
+
+/* Submit the receives reposted by reap() once there are buffers for them
+ * again, or they would only stop again right away */
+static void submit_receives(void)
+{
+	if (unsubmitted && nreceived + nlent < URING_BUFFERS)
+		enter(unsubmitted, 0);
+}
+
+
+/* Empty the completion queue: packets go to received[], send completions
+ * are counted, and receives that stopped are posted again */
+static void reap(void)
+{
+	unsigned int head = *cq_head;
+	struct io_uring_cqe *cqe;
+
+	for (; head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE); head++) {
+		cqe = &cqes[head & *cq_mask];
+		if (cqe->user_data == SEND_DATA) {
+			sends_pending--;
+			if (cqe->res >= 0) sends_done++;
+			else errno = -cqe->res;
+			continue;
+		}
+
+		if (cqe->flags & IORING_CQE_F_BUFFER) {
+			if (cqe->res > 0) {
+				received[nreceived].fd = cqe->user_data;
+				received[nreceived].bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+				received[nreceived++].len = cqe->res;
+			} else give_buffer(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+		}
+		if (!(cqe->flags & IORING_CQE_F_MORE)) {
+			/* a receive that ran out of buffers is posted again, any
+			 * other error would only come straight back */
+			if (cqe->res >= 0 || cqe->res == -ENOBUFS)
+				post_recv(cqe->user_data);
+			else {
+				errno = receive_error = -cqe->res;
+				LOG(LOG_ERR, "couldn't receive on listening socket, %m");
+				if (nfailed < URING_FAILED) {
+					failed[nfailed].fd = cqe->user_data;
+					failed[nfailed++].error = -cqe->res;
+				}
+			}
+		}
+	}
+	__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+	submit_receives();
+}
+
+
+/* Set up the ring and its receive buffers. Returns the ring's descriptor,
+ * to wait on for packets, or -1 if the kernel can't do it. */
+int uring_setup(void)
+{
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	size_t sq_size, cq_size;
+	uint8_t *sq, *cq;
+	int fd, i;
+
+	memset(&p, 0, sizeof(p));
+	/* single issuer came with multishot receives, older kernels refuse it */
+	p.flags = IORING_SETUP_SINGLE_ISSUER;
+	if ((fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0) {
+		LOG(LOG_INFO, "io_uring is not available (%m), using recvmmsg");
+		return -1;
+	}
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP && cq_size > sq_size)
+		sq_size = cq_size;
+	sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	cq = p.features & IORING_FEAT_SINGLE_MMAP ? sq :
+		mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	buf_ring = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED || buf_ring == MAP_FAILED ||
+	    !(buffers = xcalloc(URING_BUFFERS, sizeof(struct dhcpMessage))))
+		goto fail;
+
+	sq_head = (unsigned int *) (sq + p.sq_off.head);
+	sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+	sq_mask = (unsigned int *) (sq + p.sq_off.ring_mask);
+	sq_array = (unsigned int *) (sq + p.sq_off.array);
+	sq_entries = p.sq_entries;
+	cq_head = (unsigned int *) (cq + p.cq_off.head);
+	cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+	cq_mask = (unsigned int *) (cq + p.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+	/* the receives pick their buffers from buf_ring */
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t) buf_ring;
+	reg.ring_entries = URING_BUFFERS;
+	reg.bgid = URING_GROUP;
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		goto fail;
+	for (i = 0; i < URING_BUFFERS; i++)
+		give_buffer(i);
+
+	ring_fd = fd;
+	LOG(LOG_INFO, "using io_uring for packets");
+	return fd;
+
+fail:
+	LOG(LOG_INFO, "couldn't set up io_uring (%m), using recvmmsg");
+	close(fd);
+	return -1;
+}
+
+
+int uring_active(void)
+{
+	return ring_fd >= 0;
+}
+
+
+/* Start receiving the packets of listen socket fd into the ring. -1 on
+ * error, or once a receive has failed, and fd has to be read the classic
+ * way instead. */
+int uring_listen(int fd)
+{
+	if (receive_error) {
+		errno = receive_error;
+		return -1;
+	}
+	if (post_recv(fd) < 0 || enter(unsubmitted, 0) < 0)
+		return -1;
+	return 0;
+}
+
+
+/* true if the ring has received packets on fd that haven't been handed
+ * out, or the receive on fd has failed */
+int uring_ready(int fd)
+{
+	int i;
+
+	reap();
+	for (i = 0; i < nreceived; i++)
+		if (received[i].fd == fd) return 1;
+	for (i = 0; i < nfailed; i++)
+		if (failed[i].fd == fd) return 1;
+	return 0;
+}
+
+
+/* Point packets at up to max of the packets received on fd, in the order
+ * they arrived, and leave their lengths in bytes. The buffers are lent
+ * until uring_recycle(). Returns the number of packets, or once they are
+ * all handed out -1 with errno set if the receive on fd failed. The
+ * socket then has to be closed, and its replacement read with recvmmsg. */
+int uring_received(struct dhcpMessage **packets, int *bytes, int max, int fd)
+{
+	int i, j, n = 0;
+
+	reap();
+	for (i = j = 0; i < nreceived; i++) {
+		if (received[i].fd == fd && n < max) {
+			packets[n] = &buffers[received[i].bid];
+			bytes[n++] = received[i].len;
+			lent[nlent++] = received[i].bid;
+		} else received[j++] = received[i];
+	}
+	nreceived = j;
+	if (n) return n;
+
+	for (i = 0; i < nfailed; i++)
+		if (failed[i].fd == fd) {
+			errno = failed[i].error;
+			failed[i] = failed[--nfailed];
+			return -1;
+		}
+	return 0;
+}
+
+
+/* give the buffers lent by uring_received() back to the kernel */
+void uring_recycle(void)
+{
+	while (nlent)
+		give_buffer(lent[--nlent]);
+	submit_receives();
+}
+
+
+/* Send msgs on fd through the ring, like sendmmsg(), as many at a time as
+ * there are free entries. msgs only has to live until this returns, the
+ * sends have completed by then. Returns the number sent, fewer than count
+ * when one failed, errno telling why. */
+int uring_sendmsgs(int fd, struct mmsghdr *msgs, int count)
+{
+	struct io_uring_sqe *sqe;
+	int i = 0;
+
+	sends_done = 0;
+	while (i < count) {
+		for (; i < count && (sqe = get_sqe()); i++) {
+			sqe->opcode = IORING_OP_SENDMSG;
+			sqe->fd = fd;
+			sqe->addr = (uintptr_t) &msgs[i].msg_hdr;
+			sqe->len = 1;
+			sqe->user_data = SEND_DATA;
+			push_sqe();
+			sends_pending++;
+		}
+		if (!sends_pending) break;
+
+		/* datagram sends complete right away, so this seldom waits */
+		while (sends_pending) {
+			if (enter(unsubmitted, 1) < 0 && errno != EINTR && errno != EAGAIN &&
+			    errno != EBUSY)
+				return sends_done;
+			reap();
+		}
+		if (sends_done < i) break;
+	}
+	return sends_done;
+}
@@ -0,0 +1,24 @@
+/* uring.h */
+#ifndef _URING_H
+#define _URING_H
+
+#ifdef UDHCP_IO_URING
+#include <sys/socket.h>
+
+#include "packet.h"
+
+int uring_setup(void);
+int uring_active(void);
+int uring_listen(int fd);
+int uring_ready(int fd);
+int uring_received(struct dhcpMessage **packets, int *bytes, int max, int fd);
+void uring_recycle(void);
+int uring_sendmsgs(int fd, struct mmsghdr *msgs, int count);
+#else
+#define uring_setup()		-1
+#define uring_active()		0
+#define uring_listen(fd)	-1
+#define uring_ready(fd)		0
+#endif
+
+#endif
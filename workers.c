@@ -0,0 +1,330 @@
+/* workers.c
+ *
+ * Serving an interface from several threads: each worker has its own
+ * SO_REUSEPORT listen socket, the kernel steers every request to the
+ * socket of its client's shard, and each shard has a lease table of its
+ * own covering a part of the pool. A worker only takes the lock of
+ * another shard to take over an address once its own part runs out, and
+ * the main thread only takes them to write the leases out.
+ *
+ * Licensed under the GPL v2 or later, see the file LICENSE in this tarball.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+
+#include "dhcpd.h"
+#include "packet.h"
+#include "socket.h"
+#include "leases.h"
+#include "workers.h"
+#include "common.h"
+
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF	51
+#endif
+
+/* multiplier of the chaddr hash, the high half of the product is used */
+#define SHARD_HASH	0x9E3779B1
+
+/* failed reads in a row after which the server gives up, and how long a
+ * worker waits before it reads a failing socket again */
+#define WORKER_ERRORS	10
+#define WORKER_RETRY	10000	/* microseconds */
+
+static void (*serve_shard)(void);
+
+
+/* the shard a client belongs to, the same hash the steering program works out */
+static unsigned int shard_of(uint8_t *chaddr, unsigned int shards)
+{
+	uint32_t hash;
+
+	hash = ((uint32_t) chaddr[0] << 24 | chaddr[1] << 16 | chaddr[2] << 8 | chaddr[3]) ^
+		(chaddr[4] << 8 | chaddr[5]);
+	return ((uint32_t) (hash * SHARD_HASH) >> 16) % shards;
+}
+
+
+/* Classic BPF that works out shard_of() in A, for the dhcp message at
+ * offset 'at' of the packet */
+#define SHARD_CODE(at, shards) \
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (at) + offsetof(struct dhcpMessage, chaddr)), \
+	BPF_STMT(BPF_MISC | BPF_TAX, 0), \
+	BPF_STMT(BPF_LD | BPF_H | BPF_ABS, (at) + offsetof(struct dhcpMessage, chaddr) + 4), \
+	BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0), \
+	BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, SHARD_HASH), \
+	BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16), \
+	BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (shards))
+
+
+/* Steer each unicast request (from a relay) to the socket of its client's
+ * shard. The sockets of a reuseport group are numbered in the order they
+ * were bound, and the program is run on the udp payload. */
+static int steer_clients(int fd, unsigned int shards)
+{
+	struct sock_filter code[] = {
+		SHARD_CODE(0, shards),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+	};
+	struct sock_fprog prog = {sizeof(code) / sizeof(code[0]), code};
+
+	return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
+
+/* Broadcasts reach every socket of the group, so each drops the requests
+ * of clients of other shards. Socket filters are run from the udp header. */
+static int filter_clients(int fd, unsigned int shard, unsigned int shards)
+{
+	struct sock_filter code[] = {
+		SHARD_CODE(sizeof(struct udphdr), shards),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, shard, 1, 0),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+		BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF),
+	};
+	struct sock_fprog prog = {sizeof(code) / sizeof(code[0]), code};
+
+	return setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+
+/* make the config and lease table of a shard the current ones */
+static void select_shard(struct shard *shard)
+{
+	cur_config = &shard->config;
+	select_lease_table(shard->config.leases);
+}
+
+
+/* Split the pool of the current interface into server_config.workers
+ * shards, each with a copy of the config and a lease table of its own */
+void setup_shards(void)
+{
+	struct server_config_t *parent = cur_config;
+	struct shard *shard;
+	unsigned int n;
+
+	if (parent->lease_store) {
+		LOG(LOG_WARNING, "lease_store can't be used with workers, ignoring it");
+		free(parent->lease_store);
+		parent->lease_store = NULL;
+	}
+
+	parent->shards = xcalloc(parent->workers, sizeof(struct shard));
+	for (n = 0; n < parent->workers; n++) {
+		shard = &parent->shards[n];
+		shard->config = *parent;
+		shard->config.workers = 0;
+		shard->config.shards = NULL;
+		shard->config.shard = shard;
+		shard->config.next = NULL;
+		shard->parent = parent;
+		shard->index = n;
+		pthread_mutex_init(&shard->lock, NULL);
+
+		select_shard(shard);
+		init_lease_table();
+		shard_lease_table(n, parent->workers);
+	}
+	cur_config = parent;
+	select_lease_table(parent->leases);
+}
+
+
+/* Serve the shard whenever its socket has something queued. The socket
+ * can't be reopened without moving the other workers' sockets in the
+ * steering group, and a worker that stopped would leave its clients
+ * steered to a socket nobody reads, so a socket that keeps failing is
+ * fatal. */
+static void *worker(void *arg)
+{
+	struct shard *shard = arg;
+	struct pollfd pfd;
+	socklen_t len;
+	int err;
+
+	select_shard(shard);
+	pfd.fd = shard->config.socket;
+	pfd.events = POLLIN;
+	while (1) {
+		if (poll(&pfd, 1, -1) <= 0) continue;
+		if (pfd.revents & POLLNVAL) break;
+		if (pfd.revents & POLLERR) {
+			/* an icmp error for a reply sent on the socket, reading
+			 * it clears it */
+			len = sizeof(err);
+			if (getsockopt(pfd.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) break;
+			DEBUG(LOG_INFO, "worker %u of %s: %s", shard->index,
+				shard->config.interface, strerror(err));
+		}
+		if (!(pfd.revents & POLLIN)) continue;
+
+		pthread_mutex_lock(&shard->lock);
+		serve_shard();
+		pthread_mutex_unlock(&shard->lock);
+		if (shard->read_errors >= WORKER_ERRORS) break;
+		if (shard->read_errors) usleep(WORKER_RETRY);
+	}
+	LOG(LOG_ERR, "FATAL: worker %u of %s can't read its socket",
+		shard->index, shard->config.interface);
+	exit(2);
+}
+
+
+/* Open the listen sockets of the current interface's workers in shard
+ * order, steer the clients to them and start the threads, which call
+ * serve whenever their socket has something queued. -1 on error. */
+int start_workers(void (*serve)(void))
+{
+	struct shard *shard;
+	unsigned int n;
+
+	serve_shard = serve;
+	for (n = 0; n < server_config.workers; n++) {
+		shard = &server_config.shards[n];
+		shard->config.journal_fd = server_config.journal_fd;
+		shard->config.socket = listen_socket(INADDR_ANY, SERVER_PORT, server_config.interface, 1);
+		if (shard->config.socket < 0 || filter_clients(shard->config.socket, n, server_config.workers) < 0)
+			return -1;
+	}
+
+	if (steer_clients(server_config.shards[0].config.socket, server_config.workers) < 0)
+		return -1;
+
+	for (n = 0; n < server_config.workers; n++) {
+		shard = &server_config.shards[n];
+		if ((errno = pthread_create(&shard->thread, NULL, worker, shard)))
+			return -1;
+	}
+	return 0;
+}
+
+
+/* Stop the workers of the current interface from touching their leases,
+ * once they are done with the requests they are handling. The locks are
+ * always taken in shard order. */
+void lock_shards(void)
+{
+	unsigned int n;
+
+	for (n = 0; n < server_config.workers; n++)
+		pthread_mutex_lock(&server_config.shards[n].lock);
+}
+
+
+void unlock_shards(void)
+{
+	unsigned int n;
+
+	for (n = server_config.workers; n-- > 0;)
+		pthread_mutex_unlock(&server_config.shards[n].lock);
+}
+
+
+/* Select the nth lease table of the current interface, its own or that of
+ * its nth worker. Returns 0 past the last one, with the interface's own
+ * table selected again. */
+int select_table(unsigned int n)
+{
+	if (n < (server_config.workers ? server_config.workers : 1)) {
+		select_lease_table(server_config.workers ?
+				   server_config.shards[n].config.leases : server_config.leases);
+		return 1;
+	}
+	select_lease_table(server_config.leases);
+	return 0;
+}
+
+
+/* Move yiaddr into a shard, clearing out the lease any other shard has on it */
+static void claim_address(struct shard *to, uint32_t yiaddr)
+{
+	struct server_config_t *parent = to->parent;
+	unsigned int n;
+
+	for (n = 0; n < parent->workers; n++) {
+		if (n == to->index) continue;
+		select_lease_table(parent->shards[n].config.leases);
+		if (owns_address(yiaddr)) {
+			clear_lease(blank_chaddr, yiaddr);
+			give_address(yiaddr);
+		}
+	}
+	select_lease_table(to->config.leases);
+	take_address(yiaddr);
+}
+
+
+/* While loading the leases of an interface with workers, select the table
+ * of the shard a lease belongs to: that of its client, or for a lease with
+ * no client, that of the shard that has its address */
+void select_record_shard(uint8_t *chaddr, uint32_t yiaddr)
+{
+	unsigned int n;
+
+	if (!server_config.workers) return;
+
+	if (memcmp(chaddr, blank_chaddr, 16)) {
+		claim_address(&server_config.shards[shard_of(chaddr, server_config.workers)], yiaddr);
+		return;
+	}
+	for (n = 0; n < server_config.workers; n++) {
+		select_lease_table(server_config.shards[n].config.leases);
+		if (owns_address(yiaddr)) return;
+	}
+}
+
+
+/* Once the shard of the current worker has nothing left to offer, take a
+ * free or expired address over from another shard. Only the locks of
+ * later shards are waited for, an earlier one is skipped while it is
+ * busy. The address is moved over under the donor's lock and probed with
+ * an arp after it is let go, so the donor isn't held up for the arp
+ * timeout. Returns the address, 0 if there is none. */
+uint32_t borrow_address(void)
+{
+	struct shard *self = server_config.shard, *donor;
+	struct server_config_t *parent;
+	uint32_t yiaddr = 0;
+	unsigned int n;
+
+	if (!self) return 0;
+
+	parent = self->parent;
+	for (n = 1; !yiaddr && n < parent->workers;) {
+		donor = &parent->shards[(self->index + n) % parent->workers];
+		if (donor->index > self->index ? pthread_mutex_lock(&donor->lock) :
+						 pthread_mutex_trylock(&donor->lock)) {
+			n++;
+			continue;
+		}
+		select_shard(donor);
+		if (!(yiaddr = free_address(0))) yiaddr = free_address(1);
+		if (yiaddr) {
+			clear_lease(blank_chaddr, yiaddr);
+			give_address(yiaddr);
+		}
+		pthread_mutex_unlock(&donor->lock);
+
+		select_shard(self);
+		if (!yiaddr) {
+			n++;
+			continue;
+		}
+		take_address(yiaddr);
+		/* an address that is in use on the network stays in this
+		 * shard as a conflict, and the donor is asked for another */
+		if (check_ip(yiaddr) || !owns_address(yiaddr) || find_lease_by_yiaddr(yiaddr))
+			yiaddr = 0;
+	}
+	return yiaddr;
+}
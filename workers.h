@@ -0,0 +1,29 @@
+/* workers.h */
+#ifndef _WORKERS_H
+#define _WORKERS_H
+
+#include <pthread.h>
+
+#include "dhcpd.h"
+
+/* A worker thread and the shard of its interface's pool that it serves.
+ * Clients are steered to a worker by a hash of their chaddr, so each
+ * client's leases only ever live in one shard. */
+struct shard {
+	struct server_config_t config;	/* the interface's, with the shard's socket and lease table */
+	struct server_config_t *parent;	/* the interface's own config */
+	unsigned int index;
+	pthread_mutex_t lock;		/* held by the worker for each batch it handles */
+	pthread_t thread;
+	unsigned int read_errors;	/* reads of the socket that failed in a row */
+};
+
+void setup_shards(void);
+int start_workers(void (*serve)(void));
+void lock_shards(void);
+void unlock_shards(void);
+int select_table(unsigned int n);
+void select_record_shard(uint8_t *chaddr, uint32_t yiaddr);
+uint32_t borrow_address(void);
+
+#endif